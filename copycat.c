@@ -30,6 +30,30 @@ Alpha Beta Gamma
 #include <fcntl.h>
 #include <sys/ioctl.h> // For window size
 #include <sys/types.h> // ssize_t
+#include <sys/stat.h> // fstat
+#include <sys/mman.h> // mmap
+#include <sys/uio.h> // writev
+#include <sys/resource.h> // Peak memory
+#include <libgen.h> // dirname
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/signalfd.h> // SIGWINCH, SIGHUP and SIGTERM as an fd
+#include <sys/timerfd.h> // Status message expiry
+#include <sys/eventfd.h> // Wakeups from other threads
+#include <pthread.h>
+#include <sys/file.h> // flock
+#include <sys/inotify.h> // Following a file as it grows
+
+#ifdef __SSE2__
+#include <emmintrin.h> // Vectorized newline scan and search
+#endif
+#ifdef __AVX2__
+#include <immintrin.h> // Wider search, with -mavx2 or -march=native
+#endif
+#ifdef COPYCAT_BENCH
+#include <regex.h> // Reference for the regex engine
+#endif
 
 /*----- defines -----*/
 
@@ -48,6 +72,65 @@ Alpha Beta Gamma
 #define COPYCAT_TAB_STOP 4
 // Ctrl+Q quit after n times
 #define COPYCAT_QUIT_TIMES 3
+// Rows lexed ahead while waiting for a key
+#define COPYCAT_LEX_BUDGET 50000
+// Rendered rows kept per screen row, and never fewer than the minimum
+#define COPYCAT_RENDER_ROWS 2
+#define COPYCAT_RENDER_MIN 64
+// Bytes of terminal input and decoded keys buffered ahead of processing
+#define COPYCAT_INPUT_BUF 4096
+#define COPYCAT_KEY_QUEUE 1024
+// Milliseconds after an ESC for the rest of an escape sequence to arrive
+#define COPYCAT_ESC_TIMEOUT 100
+// Seconds a status message stays up
+#define COPYCAT_STATUS_TIME 10
+// Bytes of text searched as one unit of work, and most search threads
+#define COPYCAT_SEARCH_CHUNK (1 << 20)
+#define COPYCAT_SEARCH_THREADS 8
+// States a lazily built regex DFA keeps before its cache is flushed
+#define COPYCAT_DFA_STATES 1024
+// Search index: bits of a trigram hash, bytes of original rows and lines
+// of add rows per block, and most trigrams of a query looked up
+#define COPYCAT_INDEX_HASH 16
+#define COPYCAT_INDEX_WORDS ((1 << COPYCAT_INDEX_HASH) / 64)
+#define COPYCAT_INDEX_BYTES (1 << 16)
+#define COPYCAT_INDEX_LINES 256
+#define COPYCAT_INDEX_QUERY 32
+#define COPYCAT_INDEX_RUN 4
+// Blocks sampled to tell whether a query is too common to look up, and
+// the percentage of them holding it at which the index is not used
+#define COPYCAT_INDEX_SAMPLE 64
+#define COPYCAT_INDEX_COMMON 50
+// Bytes of undo records per arena chunk, and most kept in all
+#define COPYCAT_UNDO_CHUNK (1 << 16)
+#define COPYCAT_UNDO_MEMORY (256 << 20)
+// Swap file: edits written together once this many are waiting, or
+// this many milliseconds after the first
+#define COPYCAT_SWAP_OPS 256
+#define COPYCAT_SWAP_MS 500
+// Bytes of the file the loader scans before showing the first rows, and
+// then before publishing more
+#define COPYCAT_LOAD_FIRST (1 << 16)
+#define COPYCAT_LOAD_SLICE (1 << 22)
+// What wakes a loader following a file: changes to the file, and files
+// appearing in its directory in case it is rotated
+#define COPYCAT_FOLLOW_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#define COPYCAT_FOLLOW_DIR_EVENTS (IN_CREATE | IN_MOVED_TO)
+// Address space set aside for a stream, backed by memory only as it fills
+#define COPYCAT_STREAM_RESERVE (sizeof(size_t) > 4 ? (size_t)1 << 40 : (size_t)1 << 30)
+// Slices of rows handed to one writev() when saving
+#define COPYCAT_SAVE_IOV 1024
+// Milliseconds a frame may wait for input that is already pending
+#define COPYCAT_FRAME_DEFER 50
+// Unchanged cells rewritten rather than jumped over with a cursor move
+#define COPYCAT_SKIP_GAP 4
+
+// Attributes of a screen cell other than its colors
+#define CELL_BOLD (1<<0)
+#define CELL_BLINK (1<<1)
+#define CELL_INVERSE (1<<2)
+// Distinct pens a cell can have: styles, foregrounds and backgrounds
+#define CELL_PENS (8 * 10 * 10)
 
 enum editorKey {
     BACKSPACE = 127,
@@ -62,7 +145,19 @@ enum editorKey {
     HOME_KEY,   // Fn + Left Arrow
     END_KEY,    // Fn + Right Arrow
     PAGE_UP,     // Also works for Fn+Up Arrow
-    PAGE_DOWN    // Also works for Fn+Down Arrow
+    PAGE_DOWN,   // Also works for Fn+Down Arrow
+
+    PASTE_KEY,   // Bracketed paste, the text is in E.input.paste
+    REFRESH_KEY  // No key, but the screen has to be drawn again
+};
+
+// File descriptors the editor waits on, see editorWaitEvents()
+enum editorEvent {
+    EV_TERMINAL = 0,
+    EV_SIGNAL,      // signalfd for SIGWINCH, SIGHUP and SIGTERM
+    EV_TIMER,       // timerfd for status message expiry
+    EV_WAKE,        // eventfd for other threads
+    EV_COUNT
 };
 
 enum editorStyle {
@@ -124,20 +219,427 @@ struct editorSyntax {
     int flags;          // Whether to highlight strings or numbers
 };
 
+/*
+    Lexer:
+        Every syntax is compiled at startup into a table driven lexer.
+        Bytes are grouped into classes by how the rules treat them, and
+        each state has a transition per class saying which highlight the
+        byte gets and which state comes next. Highlighting a row is then
+        one table lookup per byte; only bytes that may start a comment
+        delimiter or a keyword need a closer look.
+*/
+enum lexState {
+    LX_START = 0,   // Start of the row, a '.' still begins a number
+    LX_SEP,         // After a separator, a number or keyword may start
+    LX_WORD,        // Inside a word
+    LX_NUMBER,      // Inside a number
+    LX_STRING_DQ,
+    LX_STRING_SQ,
+    LX_COMMENT,     // Inside a multi-line comment
+    LX_STATES
+};
+
+enum lexAction {
+    LX_EMIT = 0,    // Highlight the byte with hl and go to next
+    LX_DELIM,       // May start a comment delimiter, else use fallback
+    LX_KEYWORD,     // A token starts here, look it up in the keyword set
+    LX_ESCAPE       // Backslash inside a string, takes the next byte too
+};
+
+struct lexTransition {
+    unsigned char action;
+    unsigned char hl;
+    unsigned char next;
+};
+
+// At most ten classes are possible: seven special bytes, digits,
+// other separators and everything else
+#define LX_MAX_CLASSES 16
+
+struct lexer {
+    unsigned char classes[256];
+    int numclasses;
+    struct lexTransition table[LX_STATES][LX_MAX_CLASSES];
+    struct lexTransition fallback[LX_STATES][LX_MAX_CLASSES];
+    int scs_len;
+    int mcs_len;
+    int mce_len;
+};
+
+// One keyword of a syntax, decoded from the "word|" notation
+struct keywordEntry {
+    char *word;     // NULL marks a free slot
+    int len;
+    int hl;         // HL_KEYWORD1 or HL_KEYWORD2
+};
+
+// Keywords of a syntax hashed by editorCompileKeywords(), so a token is
+// matched with a single lookup rather than a pass over the whole list
+struct keywordSet {
+    struct keywordEntry *table;     // Open addressing, size is mask + 1
+    unsigned int mask;
+    int maxlen;                     // Longer tokens can't be keywords
+};
+
 // To store row data
 typedef struct erow {
-    int idx;
+    int idx;        // Row number as of the last lookup, see editorRowAt()
 
     int size;
-    char *chars;
+    char *chars;    // Points into the original buffer until first edited
+    int owned;      // chars was malloc'd by an edit (copy-on-write)
+    int line;       // Line in its buffer of the piece table
 
     unsigned char *hl;
-    int hl_open_comment;
+    int hl_in;              // State the row was last lexed in, -1 if never
+    int hl_open_comment;    // State at the end of the row
 
     int rsize;
     char *renders;
+
+    // renders and hl are only built for rows that are drawn or searched,
+    // and dropped again by least recently used order, see editorRowRender()
+    int rendered;
+    struct erow *lru_prev;
+    struct erow *lru_next;
 } erow;
 
+/*
+    Piece table:
+        The text lives in two buffers. The original buffer holds the file
+        as it was read, the add buffer holds every row created or edited
+        since. Both are line tables of erows stored in fixed size chunks,
+        so an erow never moves once created.
+        The document is a treap of pieces, each a run of consecutive lines
+        of one buffer, keyed by the number of lines in its subtree. Finding,
+        inserting or deleting row n is O(log n) wherever n is.
+*/
+enum ptBuffer {
+    PT_ORIGINAL = 0,
+    PT_ADD
+};
+
+// erows per chunk of a line table
+#define PT_CHUNK 1024
+
+struct lineTable {
+    erow **chunks;
+    int numchunks;
+    int cap;        // Room in chunks
+    int len;
+};
+
+typedef struct ptNode {
+    int buf;        // PT_ORIGINAL or PT_ADD
+    int start;      // First line of the piece in its buffer
+    int count;      // Lines in the piece
+    int lines;      // Lines in the whole subtree
+    unsigned int prio;
+    struct ptNode *left;
+    struct ptNode *right;
+} ptNode;
+
+struct pieceTable {
+    char *orig;     // Contents of the file as opened, usually mmap'd
+    size_t origlen;
+    int mapped;     // orig is a file mapping rather than malloc'd
+    int dropped;    // Original rows let go of, see editorDropRows()
+    struct lineTable table[2];
+    ptNode *root;
+};
+
+// Walks the document row by row, see rowIterInit()
+typedef struct rowIter {
+    ptNode *piece;
+    int off;        // Offset of the next row inside piece
+    int row;        // Row number of the next row
+} rowIter;
+
+// Output of a frame, see abAppend()
+struct abuf {
+    char *b;
+    int len;
+    int cap;
+};
+
+#define ABUF_INIT {NULL, 0, 0}
+
+// One character cell of the terminal, see screenFlush()
+typedef struct cell {
+    char ch;
+    unsigned char fg;       // FG_* color
+    unsigned char bg;       // BG_* color
+    unsigned char style;    // CELL_* bits
+} cell;
+
+// Bytes read from the terminal, and the keys decoded from them, both
+// kept as rings, see editorReadKey()
+struct inputQueue {
+    unsigned char buf[COPYCAT_INPUT_BUF];
+    int head;
+    int len;
+    int keys[COPYCAT_KEY_QUEUE];
+    int khead;
+    int klen;
+
+    // Text of a bracketed paste, queued as a single PASTE_KEY
+    char *paste;
+    size_t pastelen;
+    size_t pastecap;
+    int pasting;    // Between the start and end markers of a paste
+    int pasted;     // PASTE_KEY queued, paste must be kept until read
+};
+
+// Compiled regular expression, see the regex section
+enum rxOp {
+    RX_CLASS,   // Consumes a byte of cls
+    RX_SPLIT,   // Continues at both out and out1
+    RX_START,   // Only where the scan starts
+    RX_END,     // Only where the scan ends
+    RX_MATCH
+};
+
+typedef struct rxState {
+    unsigned char op;
+    int out;
+    int out1;
+    uint32_t cls[8];
+} rxState;
+
+typedef struct regex {
+    rxState *states;
+    int nstates;
+    int start;      // Entry of the program
+    int rstart;     // Entry of the program for the reversed text
+    char prefix[64];        // Every match starts with this
+    int prefixlen;
+} regex;
+
+typedef struct rxDState {
+    struct rxDState *next[256];     // NULL until first taken
+    int atstart;
+    int match;      // A match ends here
+    int endmatch;   // A match ends here if the text ends here
+    int n;
+    int set[];      // NFA states, sorted
+} rxDState;
+
+typedef struct rxDfa {
+    const regex *rx;
+    int start;
+    int unanchored;     // The program is restarted at every byte
+    rxDState **table;   // Open addressing on the state set
+    int count;
+    int flushes;
+    rxDState *init[2];
+    int *seeds;
+    int *set;
+    int *stack;
+    unsigned *mark;
+    unsigned gen;
+} rxDfa;
+
+// The DFAs one thread searches with
+typedef struct rxMatcher {
+    const regex *rx;
+    rxDfa find;     // Does the text hold a match
+    rxDfa back;     // Where do matches start
+    rxDfa end;      // Where does the match at a start end
+    char *starts;
+    int startscap;
+} rxMatcher;
+
+typedef struct searchMatch {
+    int row;
+    int col;
+    int len;
+} searchMatch;
+
+// A row with matches, the candidates for a query that extends this one
+typedef struct searchRow {
+    int row;
+    erow *e;
+} searchRow;
+
+// Rows searched by one worker, see editorSearchStart()
+struct searchChunk {
+    int row;        // Document row of the first line
+    int buf;        // Lines [line, line + count) of buf
+    int line;
+    int count;
+    searchRow *cands;       // Or only these rows
+    int ncands;
+    searchMatch *matches;
+    int nmatches;
+    int cap;
+    searchRow *rows;
+    int nrows;
+    int rowcap;
+    int done;
+};
+
+struct searchPool {
+    pthread_t threads[COPYCAT_SEARCH_THREADS];
+    int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // Chunks to hand out
+    pthread_cond_t done;    // A chunk finished
+
+    // The search under way, owned by the workers while they run
+    char *query;
+    size_t len;
+    regex *rx;      // NULL for a plain text search
+    int job;        // Tells workers their matchers are stale
+    struct searchChunk *chunks;
+    int nchunks;
+    int next;       // Next chunk to hand out
+    int running;    // Chunks being searched
+    int finished;   // Chunks done
+
+    // Matches of finished chunks in document order, only touched by the
+    // main thread, see editorSearchCollect()
+    int active;
+    searchMatch *matches;
+    int nmatches;
+    int cap;
+    int merged;     // Leading chunks whose matches are in the list
+    int total;      // Matches found so far
+    searchRow *rows;        // Rows of the listed matches
+    int nrows;
+    int rowcap;
+    int narrowed;           // Only searching rows the previous query
+    searchRow *cands;       // matched on,
+    int ncands;
+    int rest;               // and every row from here on
+
+    int regex;      // Queries are regular expressions, toggled with ^T
+    const char *error;      // Why the query did not compile
+    rxMatcher matcher;      // For the main thread
+};
+
+// Trigram bitmaps of blocks of rows, see the search index section
+struct trigramBlocks {
+    uint64_t *bits;     // COPYCAT_INDEX_WORDS a block
+    int *first;         // First line of each block
+    int nblocks;
+    int cap;
+};
+
+struct indexQuery {
+    int orig;       // The original rows are indexed
+    int n;
+    uint32_t hash[COPYCAT_INDEX_QUERY];
+};
+
+struct searchIndex {
+    int enabled;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int ready;                  // orig is built, set by the builder
+    int built;                  // and the UI thread has seen it
+    long long ms;               // and how long that took
+    struct trigramBlocks orig;  // Original rows, owned by the builder
+    struct trigramBlocks add;   // Add rows, kept up to date by edits
+    struct indexQuery last;     // Last query sampled by indexQueryInit()
+    int common;                 // and whether most blocks hold it
+};
+
+// One edit in the undo journal, see the undo section
+typedef struct undoRec {
+    struct undoRec *prev;
+    struct undoRec *next;
+    int row;
+    int col;
+    int dellen;     // Bytes removed at row, col
+    int inslen;     // and put in their place
+    int start;      // First record of an undo step
+    char text[];    // The removed bytes, then the inserted ones
+} undoRec;
+
+typedef struct undoChunk {
+    struct undoChunk *prev;
+    struct undoChunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+} undoChunk;
+
+struct undoJournal {
+    undoChunk *head;    // Oldest chunk
+    undoChunk *tail;
+    undoRec *first;     // Oldest record that can be undone
+    undoRec *last;
+    undoRec *at;        // Last record applied, NULL when all are undone
+    size_t bytes;       // Held by the chunks
+    int open;           // Typing may still grow the last record
+    int skip;           // Rest of a step that did not fit is not recorded
+    int joined;         // The next record is part of the last step
+    int replaying;      // Edits come from undo or redo, not the user
+};
+
+// Start of a swap file, then a swapRec and its inserted bytes per edit
+struct swapHeader {
+    char magic[8];
+    int64_t size;       // Size and modification time of the file the
+    int64_t mtime;      // edits apply to, in nanoseconds
+};
+
+struct swapRec {
+    int32_t row;
+    int32_t col;
+    int32_t dellen;
+    int32_t inslen;
+};
+
+struct swapLog {
+    int fd;                 // -1 without a swap file
+    char *path;
+    pthread_t thread;
+    pthread_mutex_t lock;   // Taken to append
+    pthread_mutex_t io;     // Held while writing, before lock
+    pthread_cond_t wake;
+    char *buf;              // Records waiting to be written
+    size_t len;
+    size_t cap;
+    int ops;
+    char *spare;            // Records being written
+    size_t sparecap;
+    int reset;              // Start the file over with header
+    struct swapHeader header;
+    int quit;
+};
+
+struct fileLoader {
+    int active;             // Rows are still arriving, see editorLoadStart()
+    pthread_t thread;
+    int joinable;
+    pthread_mutex_t lock;
+    char *buf;
+    size_t len;
+    struct lineTable table; // Rows the loader has found
+    int lines;              // and how many of them it has published,
+    size_t bytes;           // the bytes they take up
+    int done;
+    int cancel;
+    int ready;              // Every row is in, for main() to act on
+
+    // Streaming, see loadStream()
+    int fd;                 // -1 for a mapped file
+    int stop;               // eventfd, cancels a read that waits
+    size_t cap;             // Address space reserved for buf
+    int full;               // and it ran out
+    size_t limit;           // Bytes of rows kept, 0 for all
+    int maxrows;            // Rows kept, 0 for all
+    int input;              // What stdin was before the terminal, for `-`
+
+    // Following, see loadFollow()
+    int follow;             // Asked for with -f
+    char *path;
+    int notify;             // inotify, -1 when not following
+    int watch;              // of the file at path
+    const char *notice;     // What happened to the file, for the UI
+};
+
 struct editorConfig{
     // Cursor position
     int cx;
@@ -150,11 +652,29 @@ struct editorConfig{
 
     // Data
     int numrows;
-    erow *row;
+    struct pieceTable pt;
     int rowoff;
     int coloff;
     int dirty;  // Tracks whether data has been changed
 
+    // Rows above this have up to date lexer state, see editorSyntaxSync()
+    int hl_frontier;
+
+    // Rendered rows, most recently used first
+    erow *lru_head;
+    erow *lru_tail;
+    int numrendered;
+
+    // Frame being drawn and the frame the terminal shows
+    cell *frame;
+    cell *shadow;
+    int framerows;
+    int framecols;
+    int repaint;    // Terminal contents unknown, clear on the next flush
+    int shadow_rowoff;  // rowoff of the rows in E.shadow
+    struct abuf out;    // Kept from one frame to the next
+    long long frame_ms; // When the last frame was written
+
     // File Data
     char *filename;
 
@@ -162,10 +682,21 @@ struct editorConfig{
     char *clipboard;
 
     // StatusBar msg
-    char statusmsg[100];
+    char statusmsg[160];
     time_t statusmsg_time;
+    int prompting;  // editorPrompt() is waiting for an answer
 
     struct editorSyntax *syntax;
+    struct keywordSet *keywords;    // Compiled keywords of syntax
+    struct lexer *lexer;            // Compiled lexer of syntax
+
+    struct inputQueue input;
+    struct pollfd events[EV_COUNT];
+    struct searchPool search;
+    struct searchIndex index;
+    struct undoJournal undo;
+    struct swapLog swap;
+    struct fileLoader load;
 
     // Terminal Identity
     struct termios orig_termios;
@@ -179,10 +710,36 @@ void editorRefreshScreen();
 char *editorPrompt(char *prompt, void (*callback)(char*, int));
 int getWindowSize(int *rows, int *cols);
 void screenWipe();
+void screenResize();
+void screenCompilePens();
+int editorWaitEvents(int timeout, int *redraw);
 void editorInsertRow(int at, char *s, size_t len);
 void editorDelRow(int at);
+erow *editorRowAt(int at);
+void rowIterInit(rowIter *it, int at);
+erow *rowIterNext(rowIter *it);
 void editorRowAppendString(erow *row, char *s, size_t len);
 void editorUpdateSyntax(erow *row);
+void editorUpdateRender(erow *row);
+void editorSyntaxInvalidate(int at);
+void editorSyntaxIdle();
+void editorSearchCollect();
+void editorLoadCollect();
+void editorIndexRow(erow *row);
+void editorIndexLine(int line, erow *row);
+void editorRowTouch(erow *row);
+void editorRowEvict(erow *row);
+void editorFreeRow(erow *row);
+undoRec *undoAdd(int start, int row, int col, const char *del, int dellen,
+                 const char *ins, int inslen);
+void undoInsertChar(int row, int col, int c);
+void undoDelChar(int row, int col, int c);
+void undoInsertText(int row, int col, const char *s, size_t len);
+void undoDelRow(int at);
+void undoTildeRow();
+void swapAppend(int row, int col, int dellen, const char *ins, int inslen);
+void swapFlush();
+void swapReset();
 
 /*----- filetypes -----*/
 
@@ -403,6 +960,10 @@ struct editorSyntax HLDB[] = {
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+// Compiled keywords and lexers, in the same order as HLDB
+struct keywordSet HLDB_keywords[HLDB_ENTRIES];
+struct lexer HLDB_lexers[HLDB_ENTRIES];
+
 /*----- terminal -----*/
 
 void screenWipe() {
@@ -422,15 +983,18 @@ void screenWipe() {
     */
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
+    E.repaint = 1;
 }
 
 void die(const char* s){
+    swapFlush();
     screenWipe();
     perror(s);
     exit(1);
 }
 
 void disableRawMode(){
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if(tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1){
         die("tcsetattr");
     }
@@ -466,57 +1030,210 @@ void enableRawMode(){
     // TCSAFLUSH discards any unread input before applying changes to
     //    terminal
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+    // Bracketed paste: pasted text arrives between ESC [ 200 ~ and
+    // ESC [ 201 ~ rather than as typed keys
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey() {
-  int nread;
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN) die("read");
-  }
-
-  if (c == '\x1b') {
-      char seq[3];
-      if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-      if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-      if (seq[0] == '[') {
-          if (seq[1] >= '0' && seq[1] <= '9') {
-              if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-              if (seq[2] == '~') {
-                  switch (seq[1]) {
-                      case '3': return DEL_KEY;
-                      case '1':
-                      case '7': return HOME_KEY;
-                      case '4':
-                      case '8': return END_KEY;
-
-                      case '5': return PAGE_UP;
-                      case '6': return PAGE_DOWN;
-                  }
-              }
-          } else {
-            switch (seq[1]) {
-                case 'A': return ARROW_UP;
-                case 'B': return ARROW_DOWN;
-                case 'C': return ARROW_RIGHT;
-                case 'D': return ARROW_LEFT;
-
-                case 'H': return HOME_KEY;
-                case 'F': return END_KEY;
+// write() that carries on after short writes and interruptions
+int writeAll(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EAGAIN) {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+            } else if (errno != EINTR) {
+                return -1;
+            }
+            continue;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int inputByte(int i) {
+    return E.input.buf[(E.input.head + i) % COPYCAT_INPUT_BUF];
+}
+
+// Decodes the key at the start of the input ring into *key. Returns the
+// bytes it takes, or 0 when they have not all arrived yet
+int editorDecodeKey(int *key) {
+    struct inputQueue *in = &E.input;
+    int c = inputByte(0);
+    *key = c;
+    if (c != '\x1b') return 1;
+    if (in->len < 2) return 0;
+
+    int kind = inputByte(1);
+    if (kind == 'O') {
+        if (in->len < 3) return 0;
+        switch (inputByte(2)) {
+            case 'H': *key = HOME_KEY; break;
+            case 'F': *key = END_KEY; break;
+        }
+        return 3;
+    }
+    if (kind != '[') return 2;
+
+    // CSI: parameters, then a final byte between '@' and '~'
+    int i = 2, param = 0;
+    while (i < in->len && isdigit(inputByte(i)))
+        param = param * 10 + inputByte(i++) - '0';
+    while (i < in->len && (inputByte(i) < 0x40 || inputByte(i) > 0x7e))
+        i++;    // Modifiers and such, which are ignored
+    if (i == in->len) return 0;
+    switch (inputByte(i)) {
+        case 'A': *key = ARROW_UP; break;
+        case 'B': *key = ARROW_DOWN; break;
+        case 'C': *key = ARROW_RIGHT; break;
+        case 'D': *key = ARROW_LEFT; break;
+        case 'H': *key = HOME_KEY; break;
+        case 'F': *key = END_KEY; break;
+        case '~':
+            switch (param) {
+                case 3: *key = DEL_KEY; break;
+                case 1:
+                case 7: *key = HOME_KEY; break;
+                case 4:
+                case 8: *key = END_KEY; break;
+                case 5: *key = PAGE_UP; break;
+                case 6: *key = PAGE_DOWN; break;
+                case 200: *key = PASTE_KEY; break;
+            }
+            break;
+    }
+    return i + 1;
+}
+
+// Moves pasted bytes from the input ring to E.input.paste, returns
+// whether the end of the paste was among them
+int editorDecodePaste() {
+    struct inputQueue *in = &E.input;
+    const char *end = "\x1b[201~";
+    int n = in->len;
+    if (n > COPYCAT_INPUT_BUF - in->head) n = COPYCAT_INPUT_BUF - in->head;
+    if (in->pastelen + n > in->pastecap) {
+        in->pastecap = in->pastecap ? in->pastecap * 2 : COPYCAT_INPUT_BUF;
+        if (in->pastecap < in->pastelen + n) in->pastecap = in->pastelen + n;
+        in->paste = realloc(in->paste, in->pastecap);
+        if (in->paste == NULL) die("realloc");
+    }
+    memcpy(&in->paste[in->pastelen], &in->buf[in->head], n);
+
+    // The end marker may have started in an earlier read
+    size_t from = in->pastelen > 5 ? in->pastelen - 5 : 0;
+    char *mark = memmem(&in->paste[from], in->pastelen + n - from, end, 6);
+    if (mark != NULL)
+        n = mark + 6 - &in->paste[in->pastelen];
+    in->pastelen = mark ? (size_t)(mark - in->paste) : in->pastelen + n;
+    in->head = (in->head + n) % COPYCAT_INPUT_BUF;
+    in->len -= n;
+    return mark != NULL;
+}
+
+// Moves every complete key from the input ring to the key queue. At a
+// timeout an unfinished escape sequence is taken as a plain ESC
+void editorDecodeKeys(int timeout) {
+    struct inputQueue *in = &E.input;
+    while (in->len > 0 && in->klen < COPYCAT_KEY_QUEUE && !in->pasted) {
+        int key;
+        int n;
+        if (in->pasting) {
+            if (!editorDecodePaste()) continue;
+            in->pasting = 0;
+            in->pasted = 1;
+            key = PASTE_KEY;
+            n = 0;
+        } else {
+            n = editorDecodeKey(&key);
+            if (n == 0) {
+                if (!timeout) break;
+                key = '\x1b';
+                n = in->len;
+            } else if (key == PASTE_KEY) {
+                // Queued once the whole paste is in
+                in->pasting = 1;
+                in->pastelen = 0;
+                in->head = (in->head + n) % COPYCAT_INPUT_BUF;
+                in->len -= n;
+                continue;
             }
-          }
-      } else if (seq[0] == 'O') {
-          switch (seq[1]) {
-              case 'H': return HOME_KEY;
-              case 'F': return END_KEY;
-          }
-      }
-      return '\x1b';      
-  } else {
-      return c;
-  }
+        }
+        in->head = (in->head + n) % COPYCAT_INPUT_BUF;
+        in->len -= n;
+        in->keys[(in->khead + in->klen++) % COPYCAT_KEY_QUEUE] = key;
+    }
+}
+
+// Reads whatever the terminal has into the input ring. Returns the
+// number of bytes read
+int editorFillInput() {
+    struct inputQueue *in = &E.input;
+    int total = 0;
+    while (in->len < COPYCAT_INPUT_BUF) {
+        int tail = (in->head + in->len) % COPYCAT_INPUT_BUF;
+        int room = tail >= in->head ? COPYCAT_INPUT_BUF - tail : in->head - tail;
+        if (room > COPYCAT_INPUT_BUF - in->len) room = COPYCAT_INPUT_BUF - in->len;
+        int nread = read(STDIN_FILENO, &in->buf[tail], room);
+        if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+        if (nread <= 0) break;
+        in->len += nread;
+        total += nread;
+        // Only go on while more is waiting, read() would block otherwise
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        if (nread < room || poll(&pfd, 1, 0) <= 0) break;
+    }
+    return total;
+}
+
+// Whether a key can be read without waiting
+int editorInputPending() {
+    if (E.input.klen > 0 || E.input.len > 0) return 1;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+long long editorClockMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
+int editorReadKey() {
+    // All available input is read and decoded at once, and the keys are
+    // then handed out one by one without further syscalls. Returns
+    // REFRESH_KEY when something other than a key needs a new frame
+    struct inputQueue *in = &E.input;
+    static long long esc;   // When a lone ESC is taken as the key
+    while (in->klen == 0) {
+        int timeout = -1;
+        if (in->len > 0 && !in->pasting) {
+            // ESC, unless more follows in time. Frames drawn for the
+            // loader or the search in between don't restart the wait
+            long long now = editorClockMs();
+            if (esc == 0) esc = now + COPYCAT_ESC_TIMEOUT;
+            timeout = esc > now ? esc - now : 1;
+        } else if (E.hl_frontier < E.numrows)
+            timeout = 0;                    // Lexing ahead still to do
+        int redraw = 0;
+        int ready = editorWaitEvents(timeout, &redraw);
+        editorDecodeKeys(timeout > 0 && (ready == 0 || editorClockMs() >= esc));
+        if (in->len == 0 || in->pasting) esc = 0;
+        if (in->klen == 0 && redraw)
+            return REFRESH_KEY;
+        if (ready == 0 && timeout == 0)
+            editorSyntaxIdle();
+    }
+    int key = in->keys[in->khead];
+    in->khead = (in->khead + 1) % COPYCAT_KEY_QUEUE;
+    in->klen--;
+    if (key == PASTE_KEY)
+        in->pasted = 0;     // Further input may be decoded after this
+    return key;
 }
 
 int getCursorPosition(int *rows, int *cols){
@@ -555,29 +1272,132 @@ int getWindowSize(int *rows, int *cols){
     }
 }
 
+/*----- event loop -----*/
+
+/*
+* Everything the editor waits for is a file descriptor, and
+* editorWaitEvents() sleeps in poll() until one of them is ready: the
+* terminal, a signalfd for SIGWINCH and the signals that end the editor,
+* a timerfd for the status message and an eventfd that other threads
+* write to with editorWake(). Nothing runs while the editor is idle,
+* other than lexing ahead.
+*/
+
+void editorUpdateWindowSize() {
+    if(getWindowSize(&E.screenrows, &E.screencols) == -1)
+        die("getWindowSize");
+    E.screenrows -= 2;
+    if (E.screenrows < 1) E.screenrows = 1;
+    screenResize();
+}
+
+void editorInitEvents() {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigaddset(&mask, SIGHUP);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) die("sigprocmask");
+
+    E.events[EV_TERMINAL].fd = STDIN_FILENO;
+    E.events[EV_SIGNAL].fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    E.events[EV_TIMER].fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    E.events[EV_WAKE].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int i;
+    for (i = 0; i < EV_COUNT; i++) {
+        if (E.events[i].fd == -1) die("event fd");
+        E.events[i].events = POLLIN;
+    }
+}
+
+// Arms the timer to go off in ms milliseconds
+void editorSetTimer(int ms) {
+    if (E.events[EV_TIMER].events == 0) return;     // No event loop
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    timerfd_settime(E.events[EV_TIMER].fd, 0, &its, NULL);
+}
+
+// Interrupts editorWaitEvents(), may be called from any thread
+void editorWake() {
+    if (E.events[EV_WAKE].events == 0) return;      // No event loop
+    uint64_t one = 1;
+    write(E.events[EV_WAKE].fd, &one, sizeof(one));
+}
+
+// Waits up to timeout ms (forever when -1) and handles what became
+// ready. Sets *redraw if the screen has changed. Returns 0 on timeout
+int editorWaitEvents(int timeout, int *redraw) {
+    int ready = poll(E.events, EV_COUNT, timeout);
+    if (ready == -1) {
+        if (errno == EINTR) return -1;
+        die("poll");
+    }
+    if (ready == 0) return 0;
+
+    uint64_t count;
+    if (E.events[EV_TERMINAL].revents & (POLLIN | POLLHUP | POLLERR)) {
+        if (editorFillInput() == 0 && !(E.events[EV_TERMINAL].revents & POLLIN))
+            die("terminal hung up");
+    }
+    if (E.events[EV_SIGNAL].revents & POLLIN) {
+        struct signalfd_siginfo si;
+        int quit = 0;
+        while (read(E.events[EV_SIGNAL].fd, &si, sizeof(si)) == sizeof(si))
+            quit |= si.ssi_signo != SIGWINCH;
+        if (quit) {
+            // Hung up or told to stop, the swap file keeps the edits
+            swapFlush();
+            screenWipe();
+            exit(1);
+        }
+        editorUpdateWindowSize();
+        *redraw = 1;
+    }
+    if (E.events[EV_TIMER].revents & POLLIN) {
+        read(E.events[EV_TIMER].fd, &count, sizeof(count));
+        *redraw = 1;
+    }
+    if (E.events[EV_WAKE].revents & POLLIN) {
+        read(E.events[EV_WAKE].fd, &count, sizeof(count));
+        editorSearchCollect();
+        editorLoadCollect();
+        *redraw = 1;
+    }
+    return ready;
+}
+
 /*---------- Clipboard  --------*/
 
 void editorCopy() {
-    E.clipboard = realloc(E.clipboard, strlen(E.row[E.cy].chars) + 1);
-    strcpy(E.clipboard, E.row[E.cy].chars);
+    if (E.cy >= E.numrows) return;
+    // Rows are not NUL-terminated while they point into the original buffer
+    erow *row = editorRowAt(E.cy);
+    E.clipboard = realloc(E.clipboard, row->size + 1);
+    memcpy(E.clipboard, row->chars, row->size);
+    E.clipboard[row->size] = '\0';
 }
 
 void editorCut() {
     editorCopy();
+    undoDelRow(E.cy);
     editorDelRow(E.cy);
-    if (E.cy < E.numrows)
-        editorUpdateSyntax(&E.row[E.cy]);
-    if (E.cy < E.numrows - 1)
-        editorUpdateSyntax(&E.row[E.cy + 1]);
-    E.cx = (E.cy == E.numrows) ? 0 : E.row[E.cy].size;
+    E.cx = (E.cy == E.numrows) ? 0 : editorRowAt(E.cy)->size;
 }
 
 void editorPaste() {
     if (E.clipboard == NULL) return;
-    if (E.cy == E.numrows)
+    if (E.cy == E.numrows) {
+        undoTildeRow();
+        undoAdd(1, E.cy, 0, "", 0, E.clipboard, strlen(E.clipboard));
         editorInsertRow(E.cy, E.clipboard, strlen(E.clipboard));
-    else
-        editorRowAppendString(&E.row[E.cy], E.clipboard, strlen(E.clipboard));
+    } else {
+        erow *row = editorRowAt(E.cy);
+        undoAdd(1, E.cy, row->size, "", 0, E.clipboard, strlen(E.clipboard));
+        editorRowAppendString(row, E.clipboard, strlen(E.clipboard));
+    }
     E.cx += strlen(E.clipboard);
     
     E.dirty++;
@@ -585,136 +1405,355 @@ void editorPaste() {
 
 /*----- syntax highlighting ---*/
 
+// Filled in by editorCompileSyntax(), is_separator() runs for every byte
+char separators[256];
+
 int is_separator(int c) {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+    return separators[(unsigned char)c];
 }
 
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+unsigned int kwHash(const char *s, int len) {
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
 
-    if (E.syntax == NULL) return;
+int kwLookup(struct keywordSet *set, const char *s, int len) {
+    // Returns the highlight of the keyword s, HL_NORMAL if it isn't one
+    if (len == 0 || len > set->maxlen) return HL_NORMAL;
 
-    char **keywords = E.syntax->keywords;
+    unsigned int slot = kwHash(s, len) & set->mask;
+    while (set->table[slot].word) {
+        struct keywordEntry *e = &set->table[slot];
+        if (e->len == len && !memcmp(e->word, s, len))
+            return e->hl;
+        slot = (slot + 1) & set->mask;
+    }
+    return HL_NORMAL;
+}
 
-    char *scs = E.syntax->single_line_comment_start;
-    int scs_len = scs ? strlen(scs) : 0;
+void editorCompileKeywords(char **keywords, struct keywordSet *set) {
+    int n = 0;
+    while (keywords[n])
+        n++;
 
-    char *mcs = E.syntax->multi_line_comment_start;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    char *mce = E.syntax->multi_line_comment_end;
-    int mce_len = mce ? strlen(mce) : 0;
-    
-    int prev_sep = 1;
-    int in_string = 0;
-    
-    // Used only for ML comments
-    int in_comment = ( row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+    // At most half full keeps probe sequences short
+    unsigned int size = 16;
+    while (size < (unsigned int)n * 2)
+        size *= 2;
+    set->table = calloc(size, sizeof(struct keywordEntry));
+    set->mask = size - 1;
+    set->maxlen = 0;
 
-    int  i;
-    for (i = 0; i < row->rsize;) {
-        char c = row->renders[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NUMBER;
+    int j;
+    for (j = 0; j < n; j++) {
+        int klen = strlen(keywords[j]);
+        int kw2 = keywords[j][klen - 1] == '|';
+        if (kw2)
+            klen--;
+
+        // The first spelling in the list wins, like the linear search did
+        if (kwLookup(set, keywords[j], klen) != HL_NORMAL) continue;
+
+        unsigned int slot = kwHash(keywords[j], klen) & set->mask;
+        while (set->table[slot].word)
+            slot = (slot + 1) & set->mask;
+        set->table[slot].word = keywords[j];
+        set->table[slot].len = klen;
+        set->table[slot].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        if (klen > set->maxlen)
+            set->maxlen = klen;
+    }
+}
 
-        // Single Line Comments Highlight
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->renders[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
-        }
+// Properties of a byte that decide how the lexer treats it
+#define LXB_SCS     (1<<0)  // First byte of the single line comment start
+#define LXB_MCS     (1<<1)  // First byte of the multi-line comment start
+#define LXB_MCE     (1<<2)  // First byte of the multi-line comment end
+#define LXB_DQUOTE  (1<<3)
+#define LXB_SQUOTE  (1<<4)
+#define LXB_ESCAPE  (1<<5)
+#define LXB_DIGIT   (1<<6)
+#define LXB_DOT     (1<<7)
+#define LXB_SEP     (1<<8)
+
+struct lexTransition lexRule(int state, int props, int delims) {
+    /*
+    * The highlighting rules, applied to one byte in one state.
+    * They are only evaluated here, when editorCompileLexer() fills the
+    * tables; editorLexRow() just looks the result up.
+    * With delims unset the comment delimiters are ignored, which gives
+    * what to do when a byte turns out not to start one.
+    */
+    struct lexTransition t = {LX_EMIT, HL_NORMAL, LX_WORD};
+
+    switch (state) {
+        case LX_COMMENT:
+            t.hl = HL_COMMENT;
+            t.next = LX_COMMENT;
+            if (delims && (props & LXB_MCE))
+                t.action = LX_DELIM;
+            return t;
+
+        case LX_STRING_DQ:
+        case LX_STRING_SQ:
+            t.hl = HL_STRINGS;
+            t.next = state;
+            if (props & LXB_ESCAPE)
+                t.action = LX_ESCAPE;
+            else if ((state == LX_STRING_DQ && (props & LXB_DQUOTE)) ||
+                     (state == LX_STRING_SQ && (props & LXB_SQUOTE)))
+                t.next = LX_SEP;
+            return t;
+    }
 
-        // Multi Line Comments Highlight
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_COMMENT;
-                if (!strncmp(&row->renders[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->renders[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
-                continue;
-            }
+    // Code: LX_START, LX_SEP, LX_WORD or LX_NUMBER
+    int prev_sep = (state == LX_START || state == LX_SEP);
+    int prev_number = (state == LX_START || state == LX_NUMBER);
+
+    if (delims && (props & (LXB_SCS | LXB_MCS))) {
+        t.action = LX_DELIM;
+    } else if (props & (LXB_DQUOTE | LXB_SQUOTE)) {
+        t.hl = HL_STRINGS;
+        t.next = (props & LXB_DQUOTE) ? LX_STRING_DQ : LX_STRING_SQ;
+    } else if (((props & LXB_DIGIT) && (prev_sep || prev_number)) ||
+               ((props & LXB_DOT) && prev_number)) {
+        t.hl = HL_NUMBER;
+        t.next = LX_NUMBER;
+    } else if (prev_sep && !(props & LXB_SEP)) {
+        t.action = LX_KEYWORD;
+    } else if (props & LXB_SEP) {
+        t.next = LX_SEP;
+    }
+    return t;
+}
+
+void editorCompileLexer(struct editorSyntax *syn, struct lexer *lx) {
+    // Turns the comment delimiters, string and number rules of a syntax
+    // into byte classes and a transition table per lexer state
+    char *scs = syn->single_line_comment_start;
+    char *mcs = syn->multi_line_comment_start;
+    char *mce = syn->multi_line_comment_end;
+    int ml = mcs && mce;
+
+    lx->scs_len = scs ? strlen(scs) : 0;
+    lx->mcs_len = mcs ? strlen(mcs) : 0;
+    lx->mce_len = mce ? strlen(mce) : 0;
+
+    int strings = syn->flags & HL_HIGHLIGHT_STRINGS;
+    int numbers = syn->flags & HL_HIGHLIGHT_NUMBERS;
+
+    // Bytes with the same properties share a class
+    int classprops[LX_MAX_CLASSES];
+    lx->numclasses = 0;
+    int c;
+    for (c = 0; c < 256; c++) {
+        int props = 0;
+        if (scs && c == (unsigned char)scs[0]) props |= LXB_SCS;
+        if (ml && c == (unsigned char)mcs[0]) props |= LXB_MCS;
+        if (ml && c == (unsigned char)mce[0]) props |= LXB_MCE;
+        if (strings && c == '"') props |= LXB_DQUOTE;
+        if (strings && c == '\'') props |= LXB_SQUOTE;
+        if (strings && c == '\\') props |= LXB_ESCAPE;
+        if (numbers && isdigit(c)) props |= LXB_DIGIT;
+        if (numbers && c == '.') props |= LXB_DOT;
+        if (is_separator(c)) props |= LXB_SEP;
+
+        int cls;
+        for (cls = 0; cls < lx->numclasses; cls++)
+            if (classprops[cls] == props) break;
+        if (cls == lx->numclasses)
+            classprops[lx->numclasses++] = props;
+        lx->classes[c] = cls;
+    }
+
+    int state, cls;
+    for (state = 0; state < LX_STATES; state++) {
+        for (cls = 0; cls < lx->numclasses; cls++) {
+            lx->table[state][cls] = lexRule(state, classprops[cls], 1);
+            lx->fallback[state][cls] = lexRule(state, classprops[cls], 0);
         }
+    }
+}
 
-        // String Highlight
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRINGS;
+void editorCompileSyntax() {
+    // Done once at startup for every entry of HLDB
+    int c;
+    for (c = 0; c < 256; c++)
+        separators[c] = isspace(c) || c == '\0' ||
+                        strchr(",.()+-/*=~%<>[];", c) != NULL;
+
+    unsigned int j;
+    for (j = 0; j < HLDB_ENTRIES; j++) {
+        editorCompileKeywords(HLDB[j].keywords, &HLDB_keywords[j]);
+        editorCompileLexer(&HLDB[j], &HLDB_lexers[j]);
+    }
+}
 
-                // Two characters at once
-                if (c == '\\' && i + 1< row->size) {
-                    row->hl[i+1] = HL_STRINGS;
-                    i += 2;
+int editorLexRow(char *s, int len, unsigned char *hl, int in_comment) {
+    // Highlights len bytes of s into hl, starting inside a multi-line
+    // comment if in_comment is set. s doesn't need to be NUL-terminated.
+    // Returns whether a multi-line comment is still open at the end.
+    if (E.syntax == NULL) {
+        memset(hl, HL_NORMAL, len);
+        return 0;
+    }
+
+    struct lexer *lx = E.lexer;
+    char *scs = E.syntax->single_line_comment_start;
+    char *mcs = E.syntax->multi_line_comment_start;
+    char *mce = E.syntax->multi_line_comment_end;
+
+    int state = (in_comment && mce) ? LX_COMMENT : LX_START;
+    int i = 0;
+    while (i < len) {
+        int cls = lx->classes[(unsigned char)s[i]];
+        const struct lexTransition *t = &lx->table[state][cls];
+
+        if (t->action == LX_DELIM) {
+            // Only bytes that start a delimiter get here
+            if (state == LX_COMMENT) {
+                if (i + lx->mce_len <= len && !memcmp(&s[i], mce, lx->mce_len)) {
+                    memset(&hl[i], HL_MLCOMMENT, lx->mce_len);
+                    i += lx->mce_len;
+                    state = LX_SEP;
                     continue;
                 }
-
-                // End of Double Inverteds or Single Inverteds
-                if (c == in_string)
-                    in_string = 0;
-                i++;
-                prev_sep = 1;
-                continue;
             } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRINGS;
-                    i++;
+                if (scs && s[i] == scs[0] && i + lx->scs_len <= len &&
+                    !memcmp(&s[i], scs, lx->scs_len)) {
+                    memset(&hl[i], HL_COMMENT, len - i);
+                    return 0;
+                }
+                if (mcs && s[i] == mcs[0] && i + lx->mcs_len <= len &&
+                    !memcmp(&s[i], mcs, lx->mcs_len)) {
+                    memset(&hl[i], HL_MLCOMMENT, lx->mcs_len);
+                    i += lx->mcs_len;
+                    state = LX_COMMENT;
                     continue;
                 }
             }
+            t = &lx->fallback[state][cls];
         }
 
-        // Number Highlight
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-                (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
+        switch (t->action) {
+            case LX_EMIT:
+                hl[i++] = t->hl;
+                state = t->next;
+                break;
+
+            case LX_KEYWORD: {
+                // No keyword contains a separator, so a keyword followed
+                // by a separator is exactly the token starting here
+                int klen = 0;
+                while (i + klen < len && klen <= E.keywords->maxlen &&
+                       !is_separator(s[i + klen]))
+                    klen++;
+
+                int kw = kwLookup(E.keywords, &s[i], klen);
+                if (kw != HL_NORMAL) {
+                    memset(&hl[i], kw, klen);
+                    i += klen;
+                } else {
+                    hl[i++] = t->hl;
+                }
+                state = t->next;
+                break;
             }
+
+            case LX_ESCAPE:
+                // Two characters at once
+                hl[i++] = HL_STRINGS;
+                if (i < len)
+                    hl[i++] = HL_STRINGS;
+                break;
         }
+    }
 
-        // Keywords
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2)
-                    klen--;
-                
-                if (!strncmp(&row->renders[i], keywords[j], klen) &&
-                    is_separator(row->renders[i + klen])) {
-                        memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                        i += klen;
-                        break;
-                    }
-            }
-            if (keywords[j] != NULL){
-                prev_sep = 0;
-                continue;
+    return state == LX_COMMENT;
+}
+int editorRowInState(int at) {
+    // Lexer state a row starts in: whether the row above left a
+    // multi-line comment open
+    return at > 0 && editorRowAt(at - 1)->hl_open_comment;
+}
+
+void editorSyntaxInvalidate(int at) {
+    // Rows from `at` on may start in a different state than they were
+    // lexed with, they get checked again by editorSyntaxSync()
+    if (at < E.hl_frontier)
+        E.hl_frontier = at;
+}
+
+void editorSyntaxSync(int at) {
+    /*
+    * Brings the lexer state of rows [0, at) up to date.
+    * Instead of recursing into the next row whenever a row's end state
+    * changes, every row remembers the state it was lexed with (hl_in)
+    * and the one it ends in (hl_open_comment). Rows above E.hl_frontier
+    * are known to be consistent. Walking down from there, a row is only
+    * lexed again when the state coming from above differs from hl_in,
+    * so propagation stops as soon as the states converge.
+    */
+    static unsigned char *scratch = NULL;
+    static int scratchlen = 0;
+
+    if (at > E.numrows) at = E.numrows;
+    if (E.hl_frontier >= at) return;
+
+    int in = editorRowInState(E.hl_frontier);
+    rowIter it;
+    erow *row;
+    rowIterInit(&it, E.hl_frontier);
+    while (E.hl_frontier < at && (row = rowIterNext(&it)) != NULL) {
+        if (row->hl_in != in) {
+            // Only the end state is needed here, hl is redone if the
+            // row is drawn
+            if (scratchlen <= row->size) {
+                scratchlen = row->size + 1;
+                scratch = realloc(scratch, scratchlen);
             }
+            editorRowEvict(row);
+            row->hl_open_comment = editorLexRow(row->chars, row->size, scratch, in);
+            row->hl_in = in;
         }
-
-        prev_sep = is_separator(c);
-        i++;
+        in = row->hl_open_comment;
+        E.hl_frontier++;
     }
+}
+
+void editorSyntaxIdle() {
+    // Spends some idle time lexing ahead, so jumping far down a big file
+    // doesn't have to lex everything above the new viewport at once
+    if (E.hl_frontier < E.numrows)
+        editorSyntaxSync(E.hl_frontier + COPYCAT_LEX_BUDGET);
+}
+
+void editorUpdateSyntax(erow *row) {
+    // Highlights a row, lexing the rows above it first if needed
+    int at = row->idx;
+    editorSyntaxSync(at);
+    row = editorRowAt(at);
+
+    if (row->renders == NULL)
+        editorUpdateRender(row);
+    row->hl = realloc(row->hl, row->rsize);
+
+    int in = editorRowInState(at);
+    int out = editorLexRow(row->renders, row->rsize, row->hl, in);
+    int changed = (row->hl_open_comment != out);
+    row->hl_in = in;
+    row->hl_open_comment = out;
+    editorRowTouch(row);
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    // The rows below were lexed with the old end state
+    if (at == E.hl_frontier || (changed && at + 1 < E.hl_frontier))
+        E.hl_frontier = at + 1;
 }
 
 int editorSyntaxToColor(int hl) {
@@ -732,6 +1771,8 @@ int editorSyntaxToColor(int hl) {
 
 void editorSelectSyntaxHighlight() {
     E.syntax = NULL;
+    E.keywords = NULL;
+    E.lexer = NULL;
     if (E.filename == NULL) return;
 
     // Pointer to the last occurence of . (period)
@@ -746,10 +1787,18 @@ void editorSelectSyntaxHighlight() {
             if ((is_ext && ext && !strcmp(ext, s->filematch[i]))||
                 (!is_ext && strstr(E.filename, s->filematch[i]))) {
                     E.syntax = s;
-
-                    int filerow;
-                    for (filerow = 0; filerow < E.numrows; filerow++)
-                        editorUpdateSyntax(&E.row[filerow]);
+                    E.keywords = &HLDB_keywords[j];
+                    E.lexer = &HLDB_lexers[j];
+
+                    // Rows get lexed again as they are drawn
+                    while (E.lru_head)
+                        editorRowEvict(E.lru_head);
+                    rowIter it;
+                    erow *row;
+                    rowIterInit(&it, 0);
+                    while ((row = rowIterNext(&it)) != NULL)
+                        row->hl_in = -1;
+                    E.hl_frontier = 0;
 
                     return;
                 }
@@ -758,10 +1807,383 @@ void editorSelectSyntaxHighlight() {
     }
 }
 
-/*----- row operations -------*/
+/*----- piece table -----*/
 
-int editorRowCxToRx(erow *row, int cx) {
-    int rx = 0;
+erow *ptRow(int buf, int line) {
+    struct lineTable *t = &E.pt.table[buf];
+    return &t->chunks[line / PT_CHUNK][line % PT_CHUNK];
+}
+
+erow *ptTableNewRow(struct lineTable *t) {
+    // Appends a zeroed erow to a line table
+    if (t->len == t->numchunks * PT_CHUNK) {
+        if (t->numchunks == t->cap) {
+            t->cap = t->cap ? t->cap * 2 : 16;
+            t->chunks = realloc(t->chunks, sizeof(erow *) * t->cap);
+        }
+        t->chunks[t->numchunks++] = malloc(sizeof(erow) * PT_CHUNK);
+    }
+    erow *row = &t->chunks[t->len / PT_CHUNK][t->len % PT_CHUNK];
+    memset(row, 0, sizeof(erow));
+    row->line = t->len++;
+    return row;
+}
+
+int ptNewRow(int buf) {
+    // Appends a zeroed erow to the line table of buf, returns its line
+    ptTableNewRow(&E.pt.table[buf]);
+    return E.pt.table[buf].len - 1;
+}
+
+unsigned int ptRandom() {
+    // xorshift32: treap priorities only need to be well spread
+    static unsigned int x = 2463534242u;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+ptNode *ptNewNode(int buf, int start, int count) {
+    ptNode *n = malloc(sizeof(ptNode));
+    n->buf = buf;
+    n->start = start;
+    n->count = count;
+    n->lines = count;
+    n->prio = ptRandom();
+    n->left = NULL;
+    n->right = NULL;
+    return n;
+}
+
+int ptLines(ptNode *n) {
+    return n ? n->lines : 0;
+}
+
+void ptUpdate(ptNode *n) {
+    n->lines = ptLines(n->left) + n->count + ptLines(n->right);
+}
+
+ptNode *ptMerge(ptNode *a, ptNode *b) {
+    // Concatenates two trees, every line of a comes before b
+    if (a == NULL) return b;
+    if (b == NULL) return a;
+    if (a->prio > b->prio) {
+        a->right = ptMerge(a->right, b);
+        ptUpdate(a);
+        return a;
+    }
+    b->left = ptMerge(a, b->left);
+    ptUpdate(b);
+    return b;
+}
+
+void ptSplit(ptNode *n, int at, ptNode **l, ptNode **r) {
+    // First `at` lines go to *l and the rest to *r.
+    // A piece straddling the split point is cut in two.
+    if (n == NULL) {
+        *l = *r = NULL;
+        return;
+    }
+    int left = ptLines(n->left);
+    if (at <= left) {
+        ptSplit(n->left, at, l, &n->left);
+        ptUpdate(n);
+        *r = n;
+    } else if (at >= left + n->count) {
+        ptSplit(n->right, at - left - n->count, &n->right, r);
+        ptUpdate(n);
+        *l = n;
+    } else {
+        int k = at - left;
+        ptNode *tail = ptNewNode(n->buf, n->start + k, n->count - k);
+        n->count = k;
+        *r = ptMerge(tail, n->right);
+        n->right = NULL;
+        ptUpdate(n);
+        *l = n;
+    }
+}
+
+ptNode *ptFind(int at, int *off) {
+    // Piece holding row `at`, *off is set to the row's offset inside it
+    ptNode *n = E.pt.root;
+    while (n) {
+        int left = ptLines(n->left);
+        if (at < left) {
+            n = n->left;
+        } else if (at < left + n->count) {
+            *off = at - left;
+            return n;
+        } else {
+            at -= left + n->count;
+            n = n->right;
+        }
+    }
+    return NULL;
+}
+
+void ptInsert(int at, int buf, int start, int count) {
+    // Inserts `count` lines of buf starting at `start` before row `at`
+    ptNode *l, *r;
+    ptSplit(E.pt.root, at, &l, &r);
+
+    // Rows typed one after another are usually consecutive in the add
+    // buffer, grow the previous piece instead of fragmenting the tree
+    ptNode *last = l;
+    while (last && last->right)
+        last = last->right;
+    if (last && last->buf == buf && last->start + last->count == start) {
+        ptNode *n;
+        for (n = l; n; n = n->right)
+            n->lines += count;
+        last->count += count;
+    } else {
+        l = ptMerge(l, ptNewNode(buf, start, count));
+    }
+
+    E.pt.root = ptMerge(l, r);
+    E.numrows = ptLines(E.pt.root);
+}
+
+ptNode *ptRemove(int at, int count) {
+    // Unlinks rows [at, at + count) and returns them as a tree
+    ptNode *l, *m, *r;
+    ptSplit(E.pt.root, at, &l, &r);
+    ptSplit(r, count, &m, &r);
+    E.pt.root = ptMerge(l, r);
+    E.numrows = ptLines(E.pt.root);
+    return m;
+}
+
+void ptFreeTree(ptNode *n) {
+    if (n == NULL) return;
+    ptFreeTree(n->left);
+    ptFreeTree(n->right);
+    free(n);
+}
+
+void ptFreeRows(ptNode *n) {
+    // Frees a tree taken out by ptRemove() along with its rows
+    if (n == NULL) return;
+    ptFreeRows(n->left);
+    ptFreeRows(n->right);
+    int i;
+    for (i = 0; i < n->count; i++)
+        editorFreeRow(ptRow(n->buf, n->start + i));
+    free(n);
+}
+
+ptNode *ptBuild(ptNode **pieces, int n) {
+    // Treap of pieces in order, built in one pass: a piece becomes the
+    // right child of the last one with a higher priority, and takes the
+    // pieces with lower priorities before it as its left subtree
+    ptNode **stack = malloc(n * sizeof(ptNode *));
+    int depth = 0, i;
+    for (i = 0; i < n; i++) {
+        ptNode *last = NULL;
+        while (depth > 0 && stack[depth - 1]->prio < pieces[i]->prio)
+            last = stack[--depth];
+        pieces[i]->left = last;
+        pieces[i]->right = NULL;
+        if (depth > 0) stack[depth - 1]->right = pieces[i];
+        stack[depth++] = pieces[i];
+    }
+    ptNode *root = depth > 0 ? stack[0] : NULL;
+    free(stack);
+    return root;
+}
+
+int ptCount(ptNode *n) {
+    // Sets lines throughout a tree built by ptBuild()
+    if (n == NULL) return 0;
+    n->lines = ptCount(n->left) + n->count + ptCount(n->right);
+    return n->lines;
+}
+
+void ptAppendPiece(ptNode ***pieces, int *n, int *cap, int buf, int start, int count) {
+    // Grows the last piece when the lines follow on from it
+    ptNode *last = *n > 0 ? (*pieces)[*n - 1] : NULL;
+    if (last && last->buf == buf && last->start + last->count == start) {
+        last->count += count;
+        return;
+    }
+    if (*n == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *pieces = realloc(*pieces, *cap * sizeof(ptNode *));
+    }
+    (*pieces)[(*n)++] = ptNewNode(buf, start, count);
+}
+
+void ptReplaceRows(const int *rows, int n, int line) {
+    /*
+    * Makes add line line + i row rows[i], for n rows in increasing
+    * order, by rebuilding the tree in one pass rather than removing and
+    * inserting every row. Replaced rows become unreferenced.
+    */
+    ptNode **pieces = NULL;
+    int npieces = 0, cap = 0;
+    int at = 0, k = 0;
+    while (at < E.numrows) {
+        int off;
+        ptNode *p = ptFind(at, &off);
+        int kept = 0;
+        for (; k < n && rows[k] < at + p->count; k++) {
+            int o = rows[k] - at;
+            if (o > kept) ptAppendPiece(&pieces, &npieces, &cap, p->buf, p->start + kept, o - kept);
+            ptAppendPiece(&pieces, &npieces, &cap, PT_ADD, line + k, 1);
+            kept = o + 1;
+        }
+        if (kept < p->count)
+            ptAppendPiece(&pieces, &npieces, &cap, p->buf, p->start + kept, p->count - kept);
+        at += p->count;
+    }
+    ptFreeTree(E.pt.root);
+    E.pt.root = ptBuild(pieces, npieces);
+    ptCount(E.pt.root);
+    E.numrows = ptLines(E.pt.root);
+    free(pieces);
+}
+
+void ptAddLine(struct lineTable *t, char *line, char *nl) {
+    // Adds an original row for [line, nl), without the line ending
+    while (nl > line && nl[-1] == '\r')
+        nl--;
+    erow *row = ptTableNewRow(t);
+    row->chars = line;
+    row->size = nl - line;
+    row->hl_in = -1;
+}
+
+void ptIndexLines(struct lineTable *t, char *buf, size_t len) {
+    // Adds an original row to t for every line of buf.
+    // Newlines are found 16 bytes at a time with SSE2 when available.
+    char *line = buf;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, nl));
+        while (mask) {
+            char *p = buf + i + __builtin_ctz(mask);
+            ptAddLine(t, line, p);
+            line = p + 1;
+            mask &= mask - 1;   // Clear the lowest set bit
+        }
+    }
+#endif
+
+    for (; i < len; i++) {
+        if (buf[i] == '\n') {
+            ptAddLine(t, line, buf + i);
+            line = buf + i + 1;
+        }
+    }
+    // Last line without a trailing newline
+    if (line < buf + len)
+        ptAddLine(t, line, buf + len);
+}
+
+erow *editorRowAt(int at) {
+    // Warning: erows never move, but the one returned stops being row at
+    // once the row is deleted, detached by an edit, see editorRowDetach(),
+    // or dropped by a bounded stream. Its renders and hl go when other
+    // rows are rendered, see editorRowRender(), and idx is only right
+    // until rows above it are inserted or deleted
+    int off;
+    ptNode *n = ptFind(at, &off);
+    if (n == NULL) return NULL;
+
+    erow *row = ptRow(n->buf, n->start + off);
+    row->idx = at;
+    return row;
+}
+
+void rowIterInit(rowIter *it, int at) {
+    it->row = at;
+    it->piece = ptFind(at, &it->off);
+}
+
+erow *rowIterNext(rowIter *it) {
+    // Returns rows in order and NULL past the last one.
+    // Like editorRowAt(), any edit invalidates the iterator.
+    if (it->piece == NULL) return NULL;
+    if (it->off == it->piece->count) {
+        it->piece = ptFind(it->row, &it->off);
+        if (it->piece == NULL) return NULL;
+    }
+    erow *row = ptRow(it->piece->buf, it->piece->start + it->off++);
+    row->idx = it->row++;
+    return row;
+}
+
+/*----- render cache -----*/
+
+void lruUnlink(erow *row) {
+    if (row->lru_prev) row->lru_prev->lru_next = row->lru_next;
+    else E.lru_head = row->lru_next;
+    if (row->lru_next) row->lru_next->lru_prev = row->lru_prev;
+    else E.lru_tail = row->lru_prev;
+    row->lru_prev = NULL;
+    row->lru_next = NULL;
+}
+
+void lruPush(erow *row) {
+    row->lru_prev = NULL;
+    row->lru_next = E.lru_head;
+    if (E.lru_head) E.lru_head->lru_prev = row;
+    else E.lru_tail = row;
+    E.lru_head = row;
+}
+
+void editorRowEvict(erow *row) {
+    // Frees renders and hl. hl_open_comment is kept for the next row.
+    if (!row->rendered) return;
+    lruUnlink(row);
+    free(row->renders);
+    free(row->hl);
+    row->renders = NULL;
+    row->hl = NULL;
+    row->rsize = 0;
+    row->rendered = 0;
+    E.numrendered--;
+}
+
+void editorRowTouch(erow *row) {
+    // Marks a row as the most recently rendered or used one and evicts
+    // the least recently used rows past the cache size
+    if (row->rendered) {
+        lruUnlink(row);
+    } else {
+        row->rendered = 1;
+        E.numrendered++;
+    }
+    lruPush(row);
+
+    int cap = E.screenrows * COPYCAT_RENDER_ROWS;
+    if (cap < COPYCAT_RENDER_MIN) cap = COPYCAT_RENDER_MIN;
+    while (E.numrendered > cap)
+        editorRowEvict(E.lru_tail);
+}
+
+erow *editorRowRender(erow *row) {
+    // Makes sure renders and hl are up to date before they are read
+    int at = row->idx;
+    editorSyntaxSync(at);
+    row = editorRowAt(at);
+    if (row->rendered && row->hl_in == editorRowInState(at))
+        editorRowTouch(row);
+    else
+        editorUpdateSyntax(row);
+    return row;
+}
+
+/*----- row operations -------*/
+
+int editorRowCxToRx(erow *row, int cx) {
+    int rx = 0;
     int j;
     for ( j = 0; j < cx; j++) {
         if (row->chars[j] == '\t')
@@ -774,7 +2196,7 @@ int editorRowCxToRx(erow *row, int cx) {
 int editorRowRxToCx(erow *row, int rx) {
     int cur_rx = 0;
     int cx;
-    for (cx = 0; cx < E.row->size; cx++) {
+    for (cx = 0; cx < row->size; cx++) {
         if (row->chars[cx] == '\t')
             cur_rx += (COPYCAT_TAB_STOP - 1) - (cur_rx % COPYCAT_TAB_STOP);
         cur_rx++;
@@ -785,7 +2207,7 @@ int editorRowRxToCx(erow *row, int rx) {
 
 }
 
-void editorUpdateRow(erow *row) {
+void editorUpdateRender(erow *row) {
     int tabs=0;
     int j;
 
@@ -806,55 +2228,88 @@ void editorUpdateRow(erow *row) {
     }
     row->renders[idx] = '\0';
     row->rsize = idx;
+}
 
+void editorUpdateRow(erow *row) {
+    // Called after an edit: the row is on screen, render it right away
+    editorUpdateRender(row);
     editorUpdateSyntax(row);
+    editorIndexRow(row);
 }
 
 void editorFreeRow(erow *row) {
-    free(row->renders);
-    free(row->chars);
-    free(row->hl);
+    editorRowEvict(row);
+    if (row->owned)
+        free(row->chars);
+}
+
+erow *editorRowDetach(erow *row) {
+    // Copy-on-write: the first edit of a row moves it to the add buffer.
+    // Returns the row to edit, the old pointer must not be used after.
+    if (row->owned) return row;
+
+    int at = row->idx;
+    int rendered = row->rendered;
+    if (rendered) {
+        lruUnlink(row);
+        E.numrendered--;
+    }
+
+    int line = ptNewRow(PT_ADD);
+    erow *copy = ptRow(PT_ADD, line);
+    *copy = *row;
+    copy->line = line;
+    copy->chars = malloc(row->size + 1);
+    memcpy(copy->chars, row->chars, row->size);
+    copy->chars[row->size] = '\0';
+    copy->owned = 1;
+    copy->rendered = 0;
+
+    // renders and hl now belong to the copy
+    row->renders = NULL;
+    row->hl = NULL;
+    row->rendered = 0;
+
+    ptFreeTree(ptRemove(at, 1));
+    ptInsert(at, PT_ADD, line, 1);
+    if (rendered)
+        editorRowTouch(copy);
+    return copy;
 }
 
 void editorDelRow(int at) {
     if (at < 0 || at >= E.numrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows -at - 1));
+    ptNode *n = ptRemove(at, 1);
+    editorFreeRow(ptRow(n->buf, n->start));
+    ptFreeTree(n);
+    editorSyntaxInvalidate(at);
 
-    for(int i = at; i < E.numrows - 1; i++)
-        E.row[i].idx--;
-    
-    E.numrows--;
     E.dirty++;
 }
 
 void editorInsertRow(int at, char *s, size_t len){
     if (at < 0 || at > E.numrows) return;
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-
-    for(int i = at + 1; i <= E.numrows; i++)
-        E.row[i].idx++;
+    int line = ptNewRow(PT_ADD);
+    erow *row = ptRow(PT_ADD, line);
 
-    E.row[at].idx = at;
+    row->size = len;
+    row->chars = malloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->owned = 1;
+    row->hl_in = -1;
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-
-    E.row[at].rsize = 0;
-    E.row[at].renders = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+    ptInsert(at, PT_ADD, line, 1);
+    editorSyntaxInvalidate(at);
+    row->idx = at;
+    editorUpdateRow(row);
 
-    E.numrows++;
     E.dirty++;
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
+    row = editorRowDetach(row);
     if (at < 0 || at > row->size) at = row->size;
     row->chars = realloc(row->chars, row->size + 2);
 
@@ -868,6 +2323,7 @@ void editorRowInsertChar(erow *row, int at, int c) {
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
+    row = editorRowDetach(row);
     row->chars = realloc(row->chars, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
@@ -879,6 +2335,7 @@ void editorRowAppendString(erow *row, char *s, size_t len) {
 void editorRowDelChar(erow *row, int at) {
     if (at < 0 || at >= row->size) return;
 
+    row = editorRowDetach(row);
     memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
     row->size--;
     editorUpdateRow(row);
@@ -890,20 +2347,27 @@ void editorMoveRow(int dir) {
     // int dir : -1 for up
     //         : +1 for down
 
-    if ((dir == -1 && E.cy > 0) || (dir == 1 && E.cy < E.numrows)){
-        erow row = E.row[E.cy];
-        E.row[E.cy] = E.row[E.cy + dir];
-        E.row[E.cy + dir] = row;
-
-        E.row[E.cy + dir].idx += dir;
-        E.row[E.cy].idx -= dir;
-
-        int top = (dir == 1) ? E.cy - 1 : E.cy;
-        editorUpdateSyntax(&E.row[top]);
-        editorUpdateSyntax(&E.row[top] + 1);
-
-        if (E.cy < E.numrows - 2)
-            editorUpdateSyntax(&E.row[top] + 2);
+    if (E.cy >= E.numrows) return;
+    if ((dir == -1 && E.cy > 0) || (dir == 1 && E.cy < E.numrows - 1)){
+        // To the journal the two rows trade places as text
+        int top = (dir == 1) ? E.cy : E.cy - 1;
+        erow *a = editorRowAt(top), *b = editorRowAt(top + 1);
+        int len = a->size + 1 + b->size;
+        char *text = malloc(2 * len);
+        memcpy(text, a->chars, a->size);
+        text[a->size] = '\n';
+        memcpy(&text[a->size + 1], b->chars, b->size);
+        memcpy(&text[len], b->chars, b->size);
+        text[len + b->size] = '\n';
+        memcpy(&text[len + b->size + 1], a->chars, a->size);
+        undoAdd(1, top, 0, text, len, &text[len], len);
+        free(text);
+
+        // Moving a row is relinking its piece, the text is not copied
+        ptNode *n = ptRemove(E.cy, 1);
+        ptInsert(E.cy + dir, n->buf, n->start, 1);
+        ptFreeTree(n);
+        editorSyntaxInvalidate((dir == 1) ? E.cy : E.cy - 1);
 
         E.cy += dir;
         E.dirty++;
@@ -917,19 +2381,22 @@ void editorMoveRow(int dir) {
 void editorInsertChar(int c) {
     if (E.cy == E.numrows) {
         // Cursor is at a tilde line
+        undoTildeRow();
         editorInsertRow(E.numrows, "", 0);
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
+    undoInsertChar(E.cy, E.cx, c);
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
     E.cx++;
 }
 
 void editorInsertNewLine() {
+    undoAdd(1, E.cy, E.cx, "", 0, "\n", 1);
     if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 1);
+        editorInsertRow(E.cy, "", 0);
     } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &E.row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
+        erow *row = editorRowAt(E.cy);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        row = editorRowDetach(editorRowAt(E.cy));
         row->size = E.cx;
         row->chars[row->size] = '\0';
         editorUpdateRow(row);
@@ -938,204 +2405,2971 @@ void editorInsertNewLine() {
     E.cx = 0;
 }
 
+// Length of the line at the start of s, and in *next where the line
+// after it starts; lines end in \n, \r or \r\n
+size_t editorLineLength(const char *s, size_t len, size_t *next) {
+    size_t i = 0;
+    while (i < len && s[i] != '\n' && s[i] != '\r')
+        i++;
+    *next = i;
+    if (i < len)
+        *next += (s[i] == '\r' && i + 1 < len && s[i + 1] == '\n') ? 2 : 1;
+    return i;
+}
+
+void editorInsertText(const char *s, size_t len) {
+    /*
+    * Inserts a block of text at the cursor, as a paste does. All of the
+    * new rows go into the document as one piece, and none of them is
+    * rendered or lexed here: they are brought up to date like any other
+    * row once they are drawn.
+    */
+    if (len == 0) return;
+    if (E.cy == E.numrows) {
+        undoTildeRow();
+        editorInsertRow(E.numrows, "", 0);
+    }
+    undoInsertText(E.cy, E.cx, s, len);
+    erow *row = editorRowDetach(editorRowAt(E.cy));
+
+    size_t next;
+    size_t first = editorLineLength(s, len, &next);
+    size_t taillen = row->size - E.cx;
+    char *tail = malloc(taillen + 1);
+    memcpy(tail, &row->chars[E.cx], taillen);
+
+    // The first line goes into the cursor row, the rest of which is
+    // carried over to the end of the last line
+    int multiline = next > first;
+    row->chars = realloc(row->chars, E.cx + first + (multiline ? 0 : taillen) + 1);
+    memcpy(&row->chars[E.cx], s, first);
+    row->size = E.cx + first;
+    if (!multiline) {
+        memcpy(&row->chars[row->size], tail, taillen);
+        row->size += taillen;
+    }
+    row->chars[row->size] = '\0';
+    row->hl_in = -1;
+    editorRowEvict(row);
+    editorIndexRow(row);
+    E.cx += first;
+
+    int start = -1, count = 0;
+    while (multiline) {
+        s += next;
+        len -= next;
+        size_t linelen = editorLineLength(s, len, &next);
+        multiline = next > linelen;
+
+        int line = ptNewRow(PT_ADD);
+        erow *r = ptRow(PT_ADD, line);
+        r->size = linelen + (multiline ? 0 : taillen);
+        r->chars = malloc(r->size + 1);
+        memcpy(r->chars, s, linelen);
+        if (!multiline)
+            memcpy(&r->chars[linelen], tail, taillen);
+        r->chars[r->size] = '\0';
+        r->owned = 1;
+        r->hl_in = -1;
+        editorIndexLine(line, r);
+        if (start == -1) start = line;
+        count++;
+        E.cx = linelen;
+    }
+    if (count)
+        ptInsert(E.cy + 1, PT_ADD, start, count);
+    editorSyntaxInvalidate(E.cy);
+    E.cy += count;
+    free(tail);
+    E.dirty++;
+}
+
 void editorDelChar() {
     if (E.cy == E.numrows) return;
     if (E.cx == 0 && E.cy == 0) return;
 
-    erow *row = &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
     if (E.cx > 0) {
+        undoDelChar(E.cy, E.cx - 1, row->chars[E.cx - 1]);
         editorRowDelChar(row, E.cx - 1);
         E.cx--;
     } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy -  1], row->chars, row->size);
+        erow *prev = editorRowAt(E.cy - 1);
+        undoDelChar(E.cy - 1, prev->size, '\n');
+        E.cx = prev->size;
+        editorRowAppendString(prev, row->chars, row->size);
         editorDelRow(E.cy);
         E.cy--;
     }
 }
 
-/*----- file i/o -----*/
+void editorDeleteText(int at, int col, size_t len) {
+    // Removes len bytes from col of row at on, where a \n ends each row.
+    // Taking the \n of the last row leaves whole rows to remove, after
+    // row at cut short at col unless col is 0.
+    erow *row = editorRowDetach(editorRowAt(at));
+    erow *end = row;
+    int last = at;
+    size_t endcol = col + len;
+    while (endcol > (size_t)end->size && last + 1 < E.numrows) {
+        endcol -= end->size + 1;
+        end = editorRowAt(++last);
+    }
+    if (endcol > (size_t)end->size && col == 0) {
+        ptFreeRows(ptRemove(at, E.numrows - at));
+        editorSyntaxInvalidate(at);
+        E.dirty++;
+        return;
+    }
+
+    size_t taillen = endcol > (size_t)end->size ? 0 : end->size - endcol;
+    if (last > at) {
+        row->chars = realloc(row->chars, col + taillen + 1);
+        if (taillen) memcpy(&row->chars[col], &end->chars[endcol], taillen);
+        ptFreeRows(ptRemove(at + 1, last - at));
+    } else if (taillen) {
+        memmove(&row->chars[col], &row->chars[endcol], taillen);
+    }
+    row->size = col + taillen;
+    row->chars[row->size] = '\0';
+    row->hl_in = -1;
+    editorRowEvict(row);
+    editorIndexRow(row);
+    editorSyntaxInvalidate(at);
+    E.dirty++;
+}
 
-char *editorRowToString(int *buflen) {
-    // Warning: free() the returned array after use
+/*----- undo -----*/
 
-    int totlen = 0;
-    int j;
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1;
-    *buflen = totlen;
+/*
+ * Every edit appends a record of where it happened, the bytes it removed
+ * and the bytes it put in their place. To the journal every row ends in
+ * a \n, so the tilde line is where text is added after the last row.
+ * Records are packed one after another into chunks and linked both ways:
+ * undo walks back from E.undo.at putting the removed bytes back, redo
+ * walks forward making the edit again, so either costs the size of the
+ * edit and never the length of the history. Typing or deleting a
+ * character grows the last record rather than adding one, so a step is
+ * about a word. Past COPYCAT_UNDO_MEMORY the oldest chunks are dropped.
+ */
+
+size_t undoRecSize(int len) {
+    // Records are kept pointer aligned
+    size_t size = sizeof(undoRec) + len;
+    return (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
 
-    char *buf = malloc(totlen);     // Stores the row text
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+void undoFreeChunks(undoChunk *c) {
+    while (c) {
+        undoChunk *next = c->next;
+        E.undo.bytes -= c->size;
+        free(c);
+        c = next;
     }
+}
 
-    return buf;
+void undoClear() {
+    undoFreeChunks(E.undo.head);
+    E.undo.head = E.undo.tail = NULL;
+    E.undo.first = E.undo.last = E.undo.at = NULL;
+    E.undo.open = 0;
 }
 
-void editorOpen(char *filename){
-    free(E.filename);
-    E.filename = strdup(filename); // Duplicate the mallocated string
+void undoTruncate() {
+    // A new edit drops the records that could have been redone
+    undoRec *at = E.undo.at;
+    if (at == E.undo.last) return;
+    if (at == NULL) {
+        undoClear();
+        return;
+    }
+    undoChunk *c = E.undo.tail;
+    while ((char *)at < c->data || (char *)at >= c->data + c->used)
+        c = c->prev;
+    undoFreeChunks(c->next);
+    c->next = NULL;
+    c->used = (char *)at - c->data + undoRecSize(at->dellen + at->inslen);
+    E.undo.tail = c;
+    at->next = NULL;
+    E.undo.last = at;
+}
 
-    editorSelectSyntaxHighlight();
+int undoTrim() {
+    // Drops the oldest chunks while over the limit, along with what is
+    // left of a step they cut in two. Returns 0 if no step was left.
+    while (E.undo.bytes > COPYCAT_UNDO_MEMORY && E.undo.head != E.undo.tail) {
+        undoChunk *c = E.undo.head;
+        char *first = (char *)E.undo.first;
+        int cut = first >= c->data && first < c->data + c->used;
+        E.undo.head = c->next;
+        E.undo.head->prev = NULL;
+        E.undo.bytes -= c->size;
+        free(c);
+        if (!cut) continue;
+
+        undoRec *r = (undoRec *)E.undo.head->data;
+        while (r && !r->start)
+            r = r->next;
+        if (r == NULL) {
+            undoClear();
+            return 0;
+        }
+        r->prev = NULL;
+        E.undo.first = r;
+    }
+    return 1;
+}
 
-    FILE *fp = fopen(filename, "r");
-    if(!fp) die("fopen");
+undoRec *undoAdd(int start, int row, int col, const char *del, int dellen,
+                 const char *ins, int inslen) {
+    /*
+    * Appends a record, which begins a step of its own if start is set.
+    * Returns NULL if nothing was recorded: while replaying, or when the
+    * step is too big to keep.
+    */
+    if (E.undo.replaying) return NULL;
+    swapAppend(row, col, dellen, ins, inslen);
+    E.undo.open = 0;
+    if (E.undo.joined)
+        start = 0;
+    E.undo.joined = 0;
+    if (start)
+        E.undo.skip = 0;
+    else if (E.undo.skip)
+        return NULL;
+    undoTruncate();
+
+    size_t need = undoRecSize(dellen + inslen);
+    undoChunk *c = E.undo.tail;
+    if (c == NULL || c->size - c->used < need) {
+        size_t size = need > COPYCAT_UNDO_CHUNK ? need : COPYCAT_UNDO_CHUNK;
+        undoChunk *n = malloc(sizeof(undoChunk) + size);
+        n->prev = c;
+        n->next = NULL;
+        n->used = 0;
+        n->size = size;
+        if (c) c->next = n;
+        else E.undo.head = n;
+        E.undo.tail = c = n;
+        E.undo.bytes += size;
+    }
 
-    char *line = NULL;
+    undoRec *r = (undoRec *)&c->data[c->used];
+    c->used += need;
+    r->prev = E.undo.last;
+    r->next = NULL;
+    r->row = row;
+    r->col = col;
+    r->dellen = dellen;
+    r->inslen = inslen;
+    r->start = start;
+    memcpy(r->text, del, dellen);
+    memcpy(&r->text[dellen], ins, inslen);
+    if (E.undo.last) E.undo.last->next = r;
+    else E.undo.first = r;
+    E.undo.last = E.undo.at = r;
+
+    if (!undoTrim()) {
+        E.undo.skip = 1;
+        return NULL;
+    }
+    return r;
+}
 
-    ssize_t linelen;
-    size_t linecap = 0; // stores how much memory was allocated
+int undoGrow(undoRec *r) {
+    // Makes room for one more byte of text in the last record
+    undoChunk *c = E.undo.tail;
+    size_t at = (char *)r - c->data;
+    size_t need = undoRecSize(r->dellen + r->inslen + 1);
+    if (at + need > c->size) return 0;
+    c->used = at + need;
+    return 1;
+}
 
-    // getline usefull for assignments when the instream memory managament can not
-    // be predicted 
-    while ((linelen = getline(&line, &linecap, fp)) != -1){
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-                linelen--;
-        editorInsertRow(E.numrows, line, linelen);
+void undoInsertChar(int row, int col, int c) {
+    // Typing goes on in the last record up to the start of a new word
+    undoRec *r = E.undo.last;
+    if (E.undo.open && r->dellen == 0 && r->row == row && r->col + r->inslen == col &&
+        !(isspace((unsigned char)r->text[r->inslen - 1]) && !isspace(c)) && undoGrow(r)) {
+        r->text[r->inslen++] = c;
+        swapAppend(row, col, 0, &r->text[r->inslen - 1], 1);
+        return;
     }
-    free(line);
-    fclose(fp);
+    char ch = c;
+    E.undo.open = undoAdd(1, row, col, "", 0, &ch, 1) != NULL;
+}
 
-    E.dirty = 0;
+void undoDelChar(int row, int col, int c) {
+    // Backspace takes the character before the last record, the delete
+    // key the one after it; either stops at the end of a word
+    undoRec *r = E.undo.last;
+    int open = E.undo.open && r->inslen == 0 && r->row == row;
+    if (open && col == r->col && !(isspace((unsigned char)r->text[r->dellen - 1]) && !isspace(c)) &&
+        undoGrow(r)) {
+        r->text[r->dellen++] = c;
+        swapAppend(row, col, 1, "", 0);
+        return;
+    }
+    if (open && col + 1 == r->col && !(isspace(c) && !isspace((unsigned char)r->text[0])) &&
+        undoGrow(r)) {
+        memmove(&r->text[1], r->text, r->dellen++);
+        r->text[0] = c;
+        r->col--;
+        swapAppend(row, col, 1, "", 0);
+        return;
+    }
+    char ch = c;
+    E.undo.open = undoAdd(1, row, col, &ch, 1, "", 0) != NULL;
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
-        editorSelectSyntaxHighlight();
+void undoInsertText(int row, int col, const char *s, size_t len) {
+    // Line endings are recorded as the \n they become
+    size_t n = 0, i, next, linelen;
+    for (i = 0; i < len; i += next) {
+        linelen = editorLineLength(&s[i], len - i, &next);
+        n += linelen + (next > linelen);
     }
+    char *text = malloc(n + 1), *p = text;
+    for (i = 0; i < len; i += next) {
+        linelen = editorLineLength(&s[i], len - i, &next);
+        memcpy(p, &s[i], linelen);
+        p += linelen;
+        if (next > linelen) *p++ = '\n';
+    }
+    undoAdd(1, row, col, "", 0, text, n);
+    free(text);
+}
 
-    int len;
-    char *buf = editorRowToString(&len);
+void undoDelRow(int at) {
+    if (at < 0 || at >= E.numrows) return;
+    erow *row = editorRowAt(at);
+    char *text = malloc(row->size + 1);
+    memcpy(text, row->chars, row->size);
+    text[row->size] = '\n';
+    undoAdd(1, at, 0, text, row->size + 1, "", 0);
+    free(text);
+}
 
-    // O_RDWR: Read and write
-    // O_CREAT: Create if doesn't exist
-    // 0644: Std permission given to file
-    //          User can edit and read
-    //          Other can read only
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+void undoTildeRow() {
+    // A row added on the tilde line is the \n that ends it, undone in
+    // one step with whatever is then typed or pasted into it
+    if (E.cy == E.numrows)
+        E.undo.joined = undoAdd(1, E.numrows, 0, "", 0, "\n", 1) != NULL;
+}
 
-    if (fd != -1) {
-        // Sets the file size to specific length
-        if(ftruncate(fd, len) != -1) {
-            if(write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%dKB written to disk", len/1024);
-                return;
-            }
+void undoApply(int row, int col, int dellen, const char *ins, int inslen) {
+    // Replaces dellen bytes at row, col with ins, leaving the cursor after
+    swapAppend(row, col, dellen, ins, inslen);
+    erow *r = row < E.numrows ? editorRowAt(row) : NULL;
+    if (r && col + dellen <= r->size && memchr(ins, '\n', inslen) == NULL) {
+        // Within the row, spliced in place
+        r = editorRowDetach(r);
+        if (inslen > dellen)
+            r->chars = realloc(r->chars, r->size + inslen - dellen + 1);
+        memmove(&r->chars[col + inslen], &r->chars[col + dellen], r->size - col - dellen + 1);
+        memcpy(&r->chars[col], ins, inslen);
+        r->size += inslen - dellen;
+        r->hl_in = -1;
+        editorRowEvict(r);
+        editorIndexRow(r);
+        editorSyntaxInvalidate(row);
+        E.cy = row;
+        E.cx = col + inslen;
+        E.dirty++;
+        return;
+    }
+
+    E.undo.replaying = 1;
+    if (dellen > 0)
+        editorDeleteText(row, col, dellen);
+    E.cy = row;
+    E.cx = col;
+    if (row == E.numrows && inslen > 0) {
+        editorInsertRow(row, "", 0);
+        inslen--;
+    }
+    editorInsertText(ins, inslen);
+    E.undo.replaying = 0;
+}
+
+void editorUndo() {
+    undoRec *r = E.undo.at;
+    if (r == NULL) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    E.undo.open = 0;
+    int start;
+    do {
+        undoApply(r->row, r->col, r->inslen, r->text, r->dellen);
+        start = r->start;
+        r = r->prev;
+    } while (!start && r);
+    E.undo.at = r;
+}
+
+void editorRedo() {
+    undoRec *r = E.undo.at ? E.undo.at->next : E.undo.first;
+    if (r == NULL) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    E.undo.open = 0;
+    do {
+        undoApply(r->row, r->col, r->dellen, &r->text[r->dellen], r->inslen);
+        E.undo.at = r;
+        r = r->next;
+    } while (r && !r->start);
+}
+
+/*----- swap file -----*/
+
+/*
+ * Edits made since the last save are logged to .FILE.swp beside the file,
+ * so a crash or a dropped connection does not lose them. Typing only
+ * copies a record into a buffer; a writer thread appends the buffer to
+ * the file and fdatasync()s it once COPYCAT_SWAP_OPS records are waiting
+ * or COPYCAT_SWAP_MS after the first, so one sync covers many edits.
+ * Opening a file whose swap file holds edits to that same version of it
+ * offers to replay them. Saving starts the log over, quitting removes it.
+ */
+
+#define SWAP_MAGIC "ccswap1\n"
+
+char *swapPath(const char *filename) {
+    char *dir = strdup(filename), *base = strdup(filename);
+    char *d = dirname(dir), *b = basename(base);
+    char *path = malloc(strlen(d) + strlen(b) + 7);
+    sprintf(path, "%s/.%s.swp", d, b);
+    free(dir);
+    free(base);
+    return path;
+}
+
+void swapHeaderOf(struct swapHeader *h, const char *filename) {
+    struct stat st;
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, SWAP_MAGIC, sizeof(h->magic));
+    if (stat(filename, &st) == 0) {
+        h->size = st.st_size;
+        h->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    }
+}
 
+void swapWrite(struct swapLog *s) {
+    // Writes and syncs the records waiting, if any. The writer thread
+    // and swapFlush() take turns through io, so records stay in order.
+    pthread_mutex_lock(&s->io);
+    pthread_mutex_lock(&s->lock);
+    char *out = s->buf;
+    size_t len = s->len, cap = s->cap;
+    s->buf = s->spare;
+    s->cap = s->sparecap;
+    s->spare = out;
+    s->sparecap = cap;
+    s->len = 0;
+    s->ops = 0;
+    int reset = s->reset;
+    struct swapHeader h = s->header;
+    s->reset = 0;
+    pthread_mutex_unlock(&s->lock);
+
+    if (reset && ftruncate(s->fd, 0) == 0)
+        writeAll(s->fd, (char *)&h, sizeof(h));
+    if (len > 0)
+        writeAll(s->fd, out, len);
+    if (reset || len > 0)
+        fdatasync(s->fd);
+    pthread_mutex_unlock(&s->io);
+}
+
+void *swapWriter(void *arg) {
+    struct swapLog *s = arg;
+    pthread_mutex_lock(&s->lock);
+    while (!s->quit) {
+        if (s->len == 0 && !s->reset) {
+            pthread_cond_wait(&s->wake, &s->lock);
+            continue;
         }
-        close(fd);
+        // Let more edits gather, unless enough are waiting already
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_nsec += COPYCAT_SWAP_MS * 1000000L;
+        until.tv_sec += until.tv_nsec / 1000000000;
+        until.tv_nsec %= 1000000000;
+        while (!s->quit && !s->reset && s->ops < COPYCAT_SWAP_OPS &&
+               pthread_cond_timedwait(&s->wake, &s->lock, &until) == 0)
+            ;
+        pthread_mutex_unlock(&s->lock);
+        swapWrite(s);
+        pthread_mutex_lock(&s->lock);
     }
-    free(buf);
-    editorSetStatusMessage("Can't Save! I/O Error:%s", strerror(errno));
+    pthread_mutex_unlock(&s->lock);
+    swapWrite(s);
+    return NULL;
 }
 
-/*----- Find --------------*/
+void swapAppend(int row, int col, int dellen, const char *ins, int inslen) {
+    struct swapLog *s = &E.swap;
+    if (s->path == NULL) return;
+    struct swapRec r = {row, col, dellen, inslen};
+    pthread_mutex_lock(&s->lock);
+    size_t need = s->len + sizeof(r) + inslen;
+    if (need > s->cap) {
+        char *buf = realloc(s->buf, need * 2);
+        if (buf == NULL) {
+            // die() flushes what the log already holds
+            pthread_mutex_unlock(&s->lock);
+            die("realloc");
+        }
+        s->buf = buf;
+        s->cap = need * 2;
+    }
+    memcpy(&s->buf[s->len], &r, sizeof(r));
+    memcpy(&s->buf[s->len + sizeof(r)], ins, inslen);
+    // The writer waits for a first record, then for enough of them
+    int wake = s->len == 0 || ++s->ops == COPYCAT_SWAP_OPS;
+    s->len = need;
+    if (wake) pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+}
 
-void editorFindCallback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
+void swapFlush() {
+    // Before an exit that leaves the swap file behind
+    if (E.swap.path) swapWrite(&E.swap);
+}
 
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
+void swapClose() {
+    // The edits are saved or given up on, the log goes
+    struct swapLog *s = &E.swap;
+    if (s->path == NULL) return;
+    pthread_mutex_lock(&s->lock);
+    s->len = 0;
+    s->reset = 0;
+    s->quit = 1;
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    unlink(s->path);
+    close(s->fd);
+    free(s->path);
+    s->path = NULL;
+}
 
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
+int swapReplay(const char *log, size_t len, int apply, size_t *end) {
+    // Counts the whole records after the header, or applies them when
+    // apply is set, stopping at one that does not fit the document.
+    // *end is set past the last record taken.
+    size_t at = sizeof(struct swapHeader);
+    int n = 0;
+    while (at + sizeof(struct swapRec) <= len) {
+        struct swapRec r;
+        memcpy(&r, &log[at], sizeof(r));
+        if (r.dellen < 0 || r.inslen < 0 || (size_t)r.inslen > len - at - sizeof(r))
+            break;
+        if (apply) {
+            if (r.row < 0 || r.row > E.numrows || r.col < 0) break;
+            if (r.row == E.numrows ? r.col > 0 || r.dellen > 0 : r.col > editorRowAt(r.row)->size)
+                break;
+            undoApply(r.row, r.col, r.dellen, &log[at + sizeof(r)], r.inslen);
+        }
+        at += sizeof(r) + r.inslen;
+        n++;
     }
+    *end = at;
+    return n;
+}
 
-    if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = -1;
+int swapTake(char **path) {
+    // Opens and locks the swap file of E.filename, -1 if it can't be had
+    if (E.swap.path || E.filename == NULL) return -1;
+    *path = swapPath(E.filename);
+    int fd = open(*path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        free(*path);
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+        editorSetStatusMessage("Swap file in use by another copycat, edits are not logged");
+        close(fd);
+        free(*path);
+        return -1;
+    }
+    return fd;
+}
+
+void swapStart(int fd, char *path, struct swapHeader *h, int keep) {
+    // Starts the log over at h, or after the records kept in it, and
+    // starts the writer
+    if (!keep && (ftruncate(fd, 0) == -1 || writeAll(fd, (char *)h, sizeof(*h)) == -1)) {
+        close(fd);
+        free(path);
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
     }
+    fdatasync(fd);
+
+    struct swapLog *s = &E.swap;
+    s->fd = fd;
+    s->header = *h;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->io, NULL);
+    pthread_cond_init(&s->wake, NULL);
+    if (pthread_create(&s->thread, NULL, swapWriter, s) != 0) {
+        close(fd);
+        free(path);
+        return;
+    }
+    s->path = path;
+}
+
+void editorSwapOpen() {
+    /*
+    * Takes the swap file of E.filename, offering to replay the edits in
+    * one left behind, and starts the writer. Without a writable swap
+    * file, or with one in use by another copycat, edits are not logged.
+    */
+    char *path;
+    int fd = swapTake(&path);
+    if (fd == -1) return;
+
+    struct swapHeader h;
+    swapHeaderOf(&h, E.filename);
+    struct stat st;
+    char *log = NULL;
+    size_t len = 0, end = 0;
+    int n = 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(h)) {
+        len = st.st_size;
+        log = malloc(len);
+        if (pread(fd, log, len, 0) != (ssize_t)len) len = 0;
+        n = swapReplay(log, len, 0, &end);
+    }
+    int keep = 0;
+    if (n > 0 && memcmp(log, &h, sizeof(h)) != 0) {
+        editorSetStatusMessage("Swap file was for another version of the file, discarded");
+    } else if (n > 0) {
+        char prompt[80];
+        snprintf(prompt, sizeof(prompt), "Recover %d unsaved edits from the swap file? (y/n) %%s", n);
+        char *answer = editorPrompt(prompt, NULL);
+        if (answer && (answer[0] == 'y' || answer[0] == 'Y')) {
+            int done = swapReplay(log, len, 1, &end);
+            keep = 1;
+            editorSetStatusMessage("Recovered %d of %d edits", done, n);
+        }
+        free(answer);
+    }
+    free(log);
+    if (keep) {
+        // Edits to come follow on from the ones replayed
+        if (ftruncate(fd, end) == -1) keep = 0;
+    }
+    swapStart(fd, path, &h, keep);
+}
+
+void swapReset() {
+    // After a save the edits so far are in the file, the log starts over.
+    // A swap file left behind for the name saved to is not offered: its
+    // edits don't apply to what was just saved
+    struct swapLog *s = &E.swap;
+    if (s->path == NULL) {
+        char *path;
+        int fd = swapTake(&path);
+        if (fd == -1) return;
+        struct swapHeader h;
+        swapHeaderOf(&h, E.filename);
+        swapStart(fd, path, &h, 0);
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    s->len = 0;
+    s->ops = 0;
+    s->reset = 1;
+    swapHeaderOf(&s->header, E.filename);
+    pthread_cond_signal(&s->wake);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*----- file i/o -----*/
+
+/*
+ * A file is mapped at once, but its lines are found by a loader thread a
+ * slice at a time, the first slice small so that the first screen shows
+ * right away. After each slice the loader publishes how many rows it has
+ * and wakes the event loop, and editorLoadCollect() appends them to the
+ * document. The loader only grows its chunk array under the lock, which
+ * is also held while chunk pointers are copied out of it. The document
+ * is read-only until the load is done, and stays so if the load is
+ * cancelled.
+ *
+ * Pipes, stdin and files that can't be mapped are streamed instead: they
+ * are read into a large reservation of address space that is only backed
+ * by memory as it fills, so rows can point into one contiguous buffer as
+ * they do into a mapping. With a memory limit the oldest rows of a stream
+ * are dropped, and their pages given back, once it holds more than that.
+ */
+
+void loadReserve(struct fileLoader *l, size_t len) {
+    // Makes room in the chunk array for the rows of len more bytes
+    struct lineTable *t = &l->table;
+    size_t need = ((size_t)t->len + len + 1) / PT_CHUNK + 2;
+    if (need <= (size_t)t->cap) return;
+    pthread_mutex_lock(&l->lock);
+    while ((size_t)t->cap < need)
+        t->cap = t->cap ? t->cap * 2 : 64;
+    t->chunks = realloc(t->chunks, sizeof(erow *) * t->cap);
+    pthread_mutex_unlock(&l->lock);
+}
+
+int loadPublish(struct fileLoader *l, size_t bytes) {
+    // Returns whether the load was cancelled
+    pthread_mutex_lock(&l->lock);
+    l->lines = l->table.len;
+    l->bytes = bytes;
+    int cancel = l->cancel;
+    pthread_mutex_unlock(&l->lock);
+    editorWake();
+    return cancel;
+}
+
+void loadMapped(struct fileLoader *l) {
+    size_t at = 0, slice = COPYCAT_LOAD_FIRST;
+    while (at < l->len) {
+        size_t end = at + slice < l->len ? at + slice : l->len;
+        if (end < l->len) {
+            // Slices end after a newline, a longer line is taken whole
+            char *nl = memrchr(&l->buf[at], '\n', end - at);
+            if (nl == NULL) nl = memchr(&l->buf[end], '\n', l->len - end);
+            end = nl ? (size_t)(nl - l->buf) + 1 : l->len;
+        }
+        loadReserve(l, end - at);
+        ptIndexLines(&l->table, &l->buf[at], end - at);
+        at = end;
+        slice = COPYCAT_LOAD_SLICE;
+        if (loadPublish(l, at)) break;
+    }
+}
+
+int loadFollow(struct fileLoader *l, size_t at) {
+    /*
+    * Called at the end of a followed file, with the complete lines read
+    * ending at at. Returns once there may be more to read, which after a
+    * truncation starts over at the beginning and after a rotation is in
+    * the new file that took the name, or -1 when following is cancelled.
+    */
+    struct stat st, now;
+    if (fstat(l->fd, &st) == 0 && st.st_size < lseek(l->fd, 0, SEEK_CUR)) {
+        // A last line without its newline is gone with the rest
+        l->len = at;
+        lseek(l->fd, 0, SEEK_SET);
+        pthread_mutex_lock(&l->lock);
+        l->notice = "truncated";
+        pthread_mutex_unlock(&l->lock);
+        return 0;
+    }
+    if (stat(l->path, &now) == -1 || now.st_ino != st.st_ino || now.st_dev != st.st_dev) {
+        // Everything written to the old file has been read by now
+        int fd = open(l->path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            inotify_rm_watch(l->notify, l->watch);
+            l->watch = inotify_add_watch(l->notify, l->path, COPYCAT_FOLLOW_EVENTS);
+            close(l->fd);
+            l->fd = fd;
+            pthread_mutex_lock(&l->lock);
+            l->notice = "rotated";
+            pthread_mutex_unlock(&l->lock);
+            return 0;
+        }
+    }
+
+    struct pollfd fds[2] = {{l->notify, POLLIN, 0}, {l->stop, POLLIN, 0}};
+    while (poll(fds, 2, -1) == -1)
+        if (errno != EINTR) return -1;
+    if (fds[1].revents & POLLIN) return -1;
+    char events[4096];
+    while (read(l->notify, events, sizeof(events)) > 0)
+        ;
+    return 0;
+}
+
+void loadStream(struct fileLoader *l) {
+    // Reads until EOF, publishing the complete lines read so far whenever
+    // the next read would wait or a slice has come in
+    struct pollfd fds[2] = {{l->fd, POLLIN, 0}, {l->stop, POLLIN, 0}};
+    size_t at = 0, published = 0;
+    while (1) {
+        int ready = poll(fds, 2, at > published ? 0 : -1);
+        if (ready == -1 && errno == EINTR) continue;
+        if (ready == -1) break;
+        if (fds[1].revents & POLLIN) break;
+        if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            if (loadPublish(l, at)) break;
+            published = at;
+            continue;
+        }
+        if (l->len == l->cap) {
+            l->full = 1;
+            break;
+        }
+        size_t room = l->cap - l->len;
+        ssize_t nread = read(l->fd, &l->buf[l->len],
+            room < COPYCAT_LOAD_SLICE ? room : COPYCAT_LOAD_SLICE);
+        if (nread == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (nread == -1) break;
+        if (nread == 0) {
+            // The end, unless the file is followed
+            if (l->notify == -1) break;
+            if (at > published) {
+                if (loadPublish(l, at)) break;
+                published = at;
+            }
+            if (loadFollow(l, at) == -1) break;
+            fds[0].fd = l->fd;
+            continue;
+        }
+        l->len += nread;
+
+        char *nl = memrchr(&l->buf[at], '\n', l->len - at);
+        if (nl) {
+            size_t end = nl - l->buf + 1;
+            loadReserve(l, end - at);
+            ptIndexLines(&l->table, &l->buf[at], end - at);
+            at = end;
+        }
+        if (at - published >= (published ? COPYCAT_LOAD_SLICE : COPYCAT_LOAD_FIRST)) {
+            if (loadPublish(l, at)) break;
+            published = at;
+        }
+    }
+    // A last line without a newline
+    if (l->len > at) {
+        loadReserve(l, l->len - at);
+        ptIndexLines(&l->table, &l->buf[at], l->len - at);
+    }
+    loadPublish(l, l->len);
+    close(l->fd);
+    if (l->notify != -1) close(l->notify);
+}
+
+void *loadWorker(void *arg) {
+    struct fileLoader *l = arg;
+    if (l->fd == -1)
+        loadMapped(l);
+    else
+        loadStream(l);
+    pthread_mutex_lock(&l->lock);
+    l->done = 1;
+    pthread_mutex_unlock(&l->lock);
+    editorWake();
+    return NULL;
+}
+
+void editorDropRows(int n) {
+    // Lets go of the first n rows of a stream, which are also the first
+    // rows of the original buffer
+    struct lineTable *t = &E.pt.table[PT_ORIGINAL];
+    char *from = ptRow(PT_ORIGINAL, E.pt.dropped)->chars;
+    ptFreeRows(ptRemove(0, n));
+    int chunk = E.pt.dropped / PT_CHUNK;
+    E.pt.dropped += n;
+    for (; chunk < E.pt.dropped / PT_CHUNK; chunk++) {
+        free(t->chunks[chunk]);
+        t->chunks[chunk] = NULL;
+    }
+    char *to = ptRow(PT_ORIGINAL, E.pt.dropped)->chars;
+    long page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)from + page - 1) & ~(uintptr_t)(page - 1);
+    uintptr_t end = (uintptr_t)to & ~(uintptr_t)(page - 1);
+    if (end > start)
+        madvise((void *)start, end - start, MADV_DONTNEED);
+
+    E.cy = E.cy > n ? E.cy - n : 0;
+    E.rowoff = E.rowoff > n ? E.rowoff - n : 0;
+    editorSyntaxInvalidate(0);
+}
+
+void editorLoadCollect() {
+    // Appends the rows published by the loader, unless a search or a
+    // prompt holds rows or the cursor that must stay where they are.
+    // main() collects again once they are done
+    struct fileLoader *l = &E.load;
+    if (!l->active || E.search.active || E.prompting) return;
+    pthread_mutex_lock(&l->lock);
+    int lines = l->lines, done = l->done;
+    size_t bytes = l->bytes;
+    const char *notice = l->notice;
+    l->notice = NULL;
+    struct lineTable *t = &E.pt.table[PT_ORIGINAL];
+    int first = t->len;
+    if (lines > first) {
+        int nchunks = (lines + PT_CHUNK - 1) / PT_CHUNK;
+        if (nchunks > t->cap) {
+            t->cap = l->table.cap;
+            t->chunks = realloc(t->chunks, sizeof(erow *) * t->cap);
+        }
+        memcpy(&t->chunks[t->numchunks], &l->table.chunks[t->numchunks],
+               sizeof(erow *) * (nchunks - t->numchunks));
+        t->numchunks = nchunks;
+        t->len = lines;
+    }
+    pthread_mutex_unlock(&l->lock);
+
+    if (notice)
+        editorSetStatusMessage("%.20s was %s, following it from the start", E.filename, notice);
+    if (lines > first) {
+        // Following keeps the cursor on the last row, if that's where it is
+        int pinned = l->follow && E.cy >= E.numrows - 1;
+        ptInsert(E.numrows, PT_ORIGINAL, first, lines - first);
+        if (l->fd != -1) E.pt.origlen = bytes;
+        if (l->fd != -1 && (l->limit || l->maxrows)) {
+            // Keep the newest rows within the limits
+            int n = 0;
+            if (l->maxrows && E.numrows > l->maxrows)
+                n = E.numrows - l->maxrows;
+            while (l->limit && E.pt.dropped + n < lines - 1 &&
+                   bytes - (size_t)(ptRow(PT_ORIGINAL, E.pt.dropped + n)->chars - E.pt.orig) > l->limit)
+                n++;
+            if (n) editorDropRows(n);
+        }
+        if (pinned) {
+            E.cy = E.numrows - 1;
+            E.cx = 0;
+        }
+    }
+    if (done) {
+        if (l->joinable) pthread_join(l->thread, NULL);
+        l->joinable = 0;
+        free(l->table.chunks);
+        if (l->stop != -1) close(l->stop);
+        l->active = 0;
+        l->ready = !l->cancel;
+        // Let go of the pages the scan touched, rows fault them back in
+        // as they get drawn
+        if (E.pt.mapped)
+            madvise(E.pt.orig, E.pt.origlen, MADV_DONTNEED);
+        if (l->full)
+            editorSetStatusMessage("Stopped reading at %zu MB, the most copycat can hold", l->cap >> 20);
+        else if (E.pt.dropped)
+            editorSetStatusMessage("Kept the last %d lines, %d earlier ones were dropped",
+                E.numrows, E.pt.dropped);
+    }
+}
+
+void editorLoadWait() {
+    struct fileLoader *l = &E.load;
+    if (!l->active) return;
+    if (l->joinable) pthread_join(l->thread, NULL);
+    l->joinable = 0;
+    editorLoadCollect();
+}
+
+void editorLoadCancel() {
+    struct fileLoader *l = &E.load;
+    pthread_mutex_lock(&l->lock);
+    l->cancel = 1;
+    pthread_mutex_unlock(&l->lock);
+    if (l->stop != -1) {
+        uint64_t one = 1;
+        write(l->stop, &one, sizeof(one));
+    }
+    editorLoadWait();
+    editorSetStatusMessage(l->follow ? "Stopped following after %d lines, the file is read-only"
+                                     : "Loading cancelled after %d lines, the file is read-only", E.numrows);
+}
+
+int editorReadOnly() {
+    // While loading, or after a cancelled load, the file can't be edited
+    struct fileLoader *l = &E.load;
+    if (!l->active && !l->cancel) return 0;
+    if (l->active && l->follow)
+        editorSetStatusMessage("Following, the file is read-only (ESC stops)");
+    else
+        editorSetStatusMessage(l->active ? "Loading, the file is read-only until done (ESC cancels)"
+                                         : "Loading was cancelled, the file is read-only");
+    return 1;
+}
+
+void editorLoadStream(int fd) {
+    // Streams fd, see loadStream()
+    struct fileLoader *l = &E.load;
+    size_t cap = COPYCAT_STREAM_RESERVE;
+    char *buf = MAP_FAILED;
+    while (cap >= COPYCAT_LOAD_SLICE && buf == MAP_FAILED) {
+        buf = mmap(NULL, cap, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (buf == MAP_FAILED) cap /= 2;
+    }
+    if (buf == MAP_FAILED) die("mmap");
+    E.pt.orig = buf;
+    E.pt.origlen = 0;
+    l->fd = fd;
+    l->buf = buf;
+    l->cap = cap;
+    l->stop = eventfd(0, EFD_CLOEXEC);
+    if (l->stop == -1) die("eventfd");
+}
+
+void loadWatch(struct fileLoader *l, char *filename) {
+    // Watches the file, and its directory for the file replacing it
+    l->path = strdup(filename);
+    char *dir = strdup(filename);
+    l->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (l->notify != -1) {
+        l->watch = inotify_add_watch(l->notify, filename, COPYCAT_FOLLOW_EVENTS);
+        if (l->watch == -1 ||
+            inotify_add_watch(l->notify, dirname(dir), COPYCAT_FOLLOW_DIR_EVENTS) == -1) {
+            close(l->notify);
+            l->notify = -1;
+        }
+    }
+    free(dir);
+    l->follow = l->notify != -1;
+}
+
+void editorLoadStart(char *filename){
+    // Maps the file, or streams it if it can't be mapped, and starts the
+    // loader. A NULL filename streams stdin, see main()
+    struct fileLoader *l = &E.load;
+    l->fd = -1;
+    l->stop = -1;
+    l->notify = -1;
+    free(E.filename);
+    E.filename = filename ? strdup(filename) : NULL;
+    E.dirty = 0;
+
+    editorSelectSyntaxHighlight();
+
+    if (filename == NULL) {
+        l->follow = 0;      // A stream is read to its end anyway
+        editorLoadStream(E.load.input);
+    } else {
+        int fd = open(filename, O_RDONLY);
+        if (fd == -1) die("open");
+
+        struct stat st;
+        if (fstat(fd, &st) == -1) die("fstat");
+
+        // Map the file rather than reading it: rows point into the mapping
+        // and are only copied when edited, so opening costs the newline
+        // index and not a heap copy of the file. Pipes and procfs files
+        // can't be mapped, and a followed file outgrows its mapping
+        l->follow = l->follow && S_ISREG(st.st_mode);
+        if (S_ISREG(st.st_mode) && st.st_size > 0 && !l->follow) {
+            char *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (buf == MAP_FAILED) die("mmap");
+            E.pt.orig = l->buf = buf;
+            E.pt.origlen = l->len = st.st_size;
+            E.pt.mapped = 1;
+            madvise(buf, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+        } else {
+            editorLoadStream(fd);
+        }
+        if (l->follow) loadWatch(l, filename);
+    }
+
+    // Rows are rendered and highlighted when first drawn, not here
+    l->active = 1;
+    pthread_mutex_init(&l->lock, NULL);
+    l->joinable = pthread_create(&l->thread, NULL, loadWorker, l) == 0;
+    if (!l->joinable) loadWorker(l);
+}
+
+void editorOpen(char *filename) {
+    editorLoadStart(filename);
+    editorLoadWait();
+}
+
+int writevAll(int fd, struct iovec *iov, int n) {
+    // writev() until all of iov is written, -1 on error
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+long long editorWriteRows(int fd) {
+    /*
+    * Writes the document to fd without building it in memory first. Rows
+    * go out as slices in writev() batches, and a run of original rows
+    * that are one newline apart in the file goes out as a single slice
+    * of the mapping. Returns the number of bytes written, -1 on error.
+    */
+    static char newline[] = "\n";
+    struct iovec iov[COPYCAT_SAVE_IOV];
+    int n = 0;
+    long long total = 0;
+    int at = 0;
+    while (at < E.numrows) {
+        int off;
+        ptNode *p = ptFind(at, &off);
+        int line = p->start, end = p->start + p->count;
+        if (p->buf == PT_ORIGINAL) {
+            // Lines ending in \r\n lost the \r, those go out row by row
+            erow *first = ptRow(PT_ORIGINAL, line);
+            erow *last = ptRow(PT_ORIGINAL, end - 1);
+            long long span = last->chars + last->size - first->chars, bytes = -1;
+            int j;
+            for (j = line; j < end; j++)
+                bytes += ptRow(PT_ORIGINAL, j)->size + 1;
+            if (bytes == span) {
+                if (n + 2 > COPYCAT_SAVE_IOV) {
+                    if (writevAll(fd, iov, n) == -1) return -1;
+                    n = 0;
+                }
+                iov[n].iov_base = first->chars;
+                iov[n++].iov_len = span;
+                iov[n].iov_base = newline;
+                iov[n++].iov_len = 1;
+                total += span + 1;
+                line = end;
+            }
+        }
+        for (; line < end; line++) {
+            if (n + 2 > COPYCAT_SAVE_IOV) {
+                if (writevAll(fd, iov, n) == -1) return -1;
+                n = 0;
+            }
+            erow *row = ptRow(p->buf, line);
+            iov[n].iov_base = row->chars;
+            iov[n++].iov_len = row->size;
+            iov[n].iov_base = newline;
+            iov[n++].iov_len = 1;
+            total += row->size + 1;
+        }
+        at += p->count;
+    }
+    if (writevAll(fd, iov, n) == -1) return -1;
+    return total;
+}
+
+void editorSave() {
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s", NULL);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntaxHighlight();
+    }
+    long long start = editorClockMs();
+
+    // Unedited rows point into the mapping of the file, so it must not be
+    // rewritten in place. Write a new file in the same directory, sync
+    // it and rename it over the old one; a crash leaves one or the other
+    // whole, and the mapping keeps the old contents alive. A symlink is
+    // followed so that its target is replaced rather than the link.
+    char *target = realpath(E.filename, NULL);
+    if (target == NULL) target = strdup(E.filename);
+    char *tmp = malloc(strlen(target) + 8);
+    sprintf(tmp, "%s.XXXXXX", target);
+    int fd = mkstemp(tmp);
+
+    if (fd != -1) {
+        // Keep the mode and owner of the file being replaced, a new file
+        // gets 0644: the user can read and write, others can read
+        struct stat st;
+        mode_t mode = 0644;
+        if (stat(target, &st) == 0) {
+            mode = st.st_mode & 07777;
+            if (fchown(fd, st.st_uid, st.st_gid) == -1) {
+                // Not ours to give away, the file becomes the user's
+            }
+        }
+        long long len;
+        if (fchmod(fd, mode) != -1 && (len = editorWriteRows(fd)) != -1 && fsync(fd) != -1) {
+            if (close(fd) != -1 && rename(tmp, target) != -1) {
+                // The rename is only durable once the directory is synced
+                int dir = open(dirname(tmp), O_RDONLY);
+                if (dir != -1) {
+                    fsync(dir);
+                    close(dir);
+                }
+                free(tmp);
+                free(target);
+                E.dirty = 0;
+                swapReset();
+                struct rusage usage;
+                getrusage(RUSAGE_SELF, &usage);
+                editorSetStatusMessage("%lldKB written to disk in %lld ms, peak memory %ldMB",
+                    len / 1024, editorClockMs() - start, usage.ru_maxrss / 1024);
+                return;
+            }
+        } else {
+            close(fd);
+        }
+        unlink(tmp);
+    }
+    free(tmp);
+    free(target);
+    editorSetStatusMessage("Can't Save! I/O Error:%s", strerror(errno));
+}
+
+/*----- regex -----*/
+
+/*
+* Regular expressions for search, without backtracking. A pattern is
+* parsed into a tree, compiled to a Thompson NFA, and run as a DFA whose
+* states are built the first time a scan reaches them and kept in a
+* cache of at most COPYCAT_DFA_STATES states. A scan is linear in the
+* length of the text whatever the pattern.
+*
+* Supported: literals, ., [...] and [^...] with ranges, \d \w \s \D \W
+* \S \t and escaped punctuation, * + ?, | and (...), ^ and $. Matches are
+* leftmost-longest and never span rows.
+*/
+
+enum rxNodeOp {RXN_CLASS, RXN_CAT, RXN_ALT, RXN_STAR, RXN_PLUS, RXN_QUEST, RXN_BOL, RXN_EOL, RXN_EMPTY};
+
+typedef struct rxNode {
+    int op;
+    int a;
+    int b;
+    uint32_t cls[8];
+} rxNode;
+
+struct rxParser {
+    const char *p;
+    rxNode *nodes;
+    int n;
+    int cap;
+    const char *error;
+};
+
+int rxNewNode(struct rxParser *ps, int op, int a, int b) {
+    if (ps->n == ps->cap) {
+        ps->cap = ps->cap ? ps->cap * 2 : 32;
+        ps->nodes = realloc(ps->nodes, ps->cap * sizeof(rxNode));
+    }
+    rxNode *node = &ps->nodes[ps->n];
+    memset(node, 0, sizeof(*node));
+    node->op = op;
+    node->a = a;
+    node->b = b;
+    return ps->n++;
+}
+
+void rxClassSet(uint32_t *cls, int c) {
+    cls[(c & 0xff) >> 5] |= 1u << (c & 31);
+}
+
+int rxClassHas(const uint32_t *cls, int c) {
+    return (cls[(c & 0xff) >> 5] >> (c & 31)) & 1;
+}
+
+int rxEscapeClass(uint32_t *cls, int c) {
+    // Adds the bytes of \c to cls, returns 0 if c is an ordinary byte
+    int i, negate = isupper(c);
+    uint32_t set[8] = {0};
+    switch (tolower(c)) {
+        case 'd': for (i = '0'; i <= '9'; i++) rxClassSet(set, i); break;
+        case 's': for (i = 0; i < 256; i++) if (isspace(i)) rxClassSet(set, i); break;
+        case 'w':
+            for (i = 0; i < 256; i++)
+                if (isalnum(i) || i == '_') rxClassSet(set, i);
+            break;
+        default: return 0;
+    }
+    for (i = 0; i < 8; i++) cls[i] |= negate ? ~set[i] : set[i];
+    return 1;
+}
+
+int rxEscapeByte(int c) {
+    return c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+}
+
+int rxParseAlt(struct rxParser *ps);
+
+int rxParseBracket(struct rxParser *ps) {
+    int node = rxNewNode(ps, RXN_CLASS, 0, 0);
+    uint32_t cls[8] = {0};
+    int negate = 0, i;
+    if (*ps->p == '^') {
+        negate = 1;
+        ps->p++;
+    }
+    int first = 1;
+    while (*ps->p && (*ps->p != ']' || first)) {
+        int lo = (unsigned char)*ps->p++;
+        first = 0;
+        if (lo == '\\' && *ps->p) {
+            lo = (unsigned char)*ps->p++;
+            if (rxEscapeClass(cls, lo)) continue;
+            lo = rxEscapeByte(lo);
+        }
+        int hi = lo;
+        if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+            hi = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (hi == '\\' && *ps->p) hi = rxEscapeByte((unsigned char)*ps->p++);
+            if (hi < lo) {
+                ps->error = "bad range";
+                return -1;
+            }
+        }
+        for (i = lo; i <= hi; i++) rxClassSet(cls, i);
+    }
+    if (*ps->p != ']') {
+        ps->error = "missing ]";
+        return -1;
+    }
+    ps->p++;
+    for (i = 0; i < 8; i++)
+        ps->nodes[node].cls[i] = negate ? ~cls[i] : cls[i];
+    return node;
+}
+
+int rxParseAtom(struct rxParser *ps) {
+    int c = (unsigned char)*ps->p++;
+    int node, i;
+    switch (c) {
+        case '(':
+            node = rxParseAlt(ps);
+            if (node < 0) return -1;
+            if (*ps->p != ')') {
+                ps->error = "missing )";
+                return -1;
+            }
+            ps->p++;
+            return node;
+        case '[':
+            return rxParseBracket(ps);
+        case '^':
+            return rxNewNode(ps, RXN_BOL, 0, 0);
+        case '$':
+            return rxNewNode(ps, RXN_EOL, 0, 0);
+        case '*': case '+': case '?':
+            ps->error = "nothing to repeat";
+            return -1;
+    }
+    node = rxNewNode(ps, RXN_CLASS, 0, 0);
+    if (c == '.') {
+        for (i = 0; i < 8; i++) ps->nodes[node].cls[i] = ~0u;
+    } else if (c == '\\') {
+        if (*ps->p == '\0') {
+            ps->error = "trailing \\";
+            return -1;
+        }
+        c = (unsigned char)*ps->p++;
+        if (!rxEscapeClass(ps->nodes[node].cls, c))
+            rxClassSet(ps->nodes[node].cls, rxEscapeByte(c));
+    } else {
+        rxClassSet(ps->nodes[node].cls, c);
+    }
+    return node;
+}
+
+int rxParseCat(struct rxParser *ps) {
+    int node = -1;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+        int atom = rxParseAtom(ps);
+        if (atom < 0) return -1;
+        while (*ps->p == '*' || *ps->p == '+' || *ps->p == '?') {
+            int op = *ps->p == '*' ? RXN_STAR : *ps->p == '+' ? RXN_PLUS : RXN_QUEST;
+            atom = rxNewNode(ps, op, atom, 0);
+            ps->p++;
+        }
+        node = node < 0 ? atom : rxNewNode(ps, RXN_CAT, node, atom);
+    }
+    return node < 0 ? rxNewNode(ps, RXN_EMPTY, 0, 0) : node;
+}
+
+int rxParseAlt(struct rxParser *ps) {
+    int node = rxParseCat(ps);
+    while (node >= 0 && *ps->p == '|') {
+        ps->p++;
+        int other = rxParseCat(ps);
+        node = other < 0 ? -1 : rxNewNode(ps, RXN_ALT, node, other);
+    }
+    return node;
+}
+
+int rxNewState(regex *rx, int op, int out, int out1) {
+    if ((rx->nstates & (rx->nstates - 1)) == 0)
+        rx->states = realloc(rx->states, (rx->nstates ? rx->nstates * 2 : 1) * sizeof(rxState));
+    rxState *st = &rx->states[rx->nstates];
+    memset(st, 0, sizeof(*st));
+    st->op = op;
+    st->out = out;
+    st->out1 = out1;
+    return rx->nstates++;
+}
+
+int rxCompileNode(regex *rx, const rxNode *nodes, int node, int next, int reverse) {
+    // Entry state of nodes[node] followed by next. The reversed program
+    // matches the reversed text: concatenations run backwards and the
+    // ends of the line trade places
+    const rxNode *n = &nodes[node];
+    int s, body;
+    switch (n->op) {
+        case RXN_CLASS:
+            s = rxNewState(rx, RX_CLASS, next, -1);
+            memcpy(rx->states[s].cls, n->cls, sizeof(n->cls));
+            return s;
+        case RXN_CAT:
+            if (reverse)
+                return rxCompileNode(rx, nodes, n->b,
+                    rxCompileNode(rx, nodes, n->a, next, reverse), reverse);
+            return rxCompileNode(rx, nodes, n->a,
+                rxCompileNode(rx, nodes, n->b, next, reverse), reverse);
+        case RXN_ALT: {
+            int a = rxCompileNode(rx, nodes, n->a, next, reverse);
+            int b = rxCompileNode(rx, nodes, n->b, next, reverse);
+            return rxNewState(rx, RX_SPLIT, a, b);
+        }
+        case RXN_STAR:
+        case RXN_PLUS:
+            s = rxNewState(rx, RX_SPLIT, -1, next);
+            body = rxCompileNode(rx, nodes, n->a, s, reverse);
+            rx->states[s].out = body;       // states may have moved
+            return n->op == RXN_STAR ? s : body;
+        case RXN_QUEST:
+            return rxNewState(rx, RX_SPLIT, rxCompileNode(rx, nodes, n->a, next, reverse), next);
+        case RXN_BOL:
+            return rxNewState(rx, reverse ? RX_END : RX_START, next, -1);
+        case RXN_EOL:
+            return rxNewState(rx, reverse ? RX_START : RX_END, next, -1);
+    }
+    return next;
+}
+
+int rxPrefix(regex *rx, const rxNode *nodes, int node) {
+    // Appends the literal bytes every match of nodes[node] starts with,
+    // returns 1 if that is all of it
+    const rxNode *n = &nodes[node];
+    int i, c = -1;
+    switch (n->op) {
+        case RXN_CAT:
+            return rxPrefix(rx, nodes, n->a) && rxPrefix(rx, nodes, n->b);
+        case RXN_BOL:
+        case RXN_EMPTY:
+            return 1;
+        case RXN_CLASS:
+            for (i = 0; i < 256; i++) {
+                if (!rxClassHas(n->cls, i)) continue;
+                if (c != -1) return 0;
+                c = i;
+            }
+            if (c == -1 || c == '\n' || rx->prefixlen == (int)sizeof(rx->prefix)) return 0;
+            rx->prefix[rx->prefixlen++] = c;
+            return 1;
+    }
+    return 0;
+}
+
+regex *rxCompile(const char *pattern, const char **error) {
+    // NULL with *error set if the pattern does not parse
+    struct rxParser ps = {pattern, NULL, 0, 0, NULL};
+    int root = rxParseAlt(&ps);
+    if (root >= 0 && *ps.p == ')') ps.error = "unmatched )";
+    if (root < 0 || ps.error) {
+        *error = ps.error;
+        free(ps.nodes);
+        return NULL;
+    }
+    regex *rx = calloc(1, sizeof(regex));
+    int match = rxNewState(rx, RX_MATCH, -1, -1);
+    rx->start = rxCompileNode(rx, ps.nodes, root, match, 0);
+    rx->rstart = rxCompileNode(rx, ps.nodes, root, match, 1);
+    rxPrefix(rx, ps.nodes, root);
+    free(ps.nodes);
+    return rx;
+}
+
+void rxFree(regex *rx) {
+    if (rx == NULL) return;
+    free(rx->states);
+    free(rx);
+}
+
+void rxDfaFlush(rxDfa *d) {
+    int i;
+    for (i = 0; i < COPYCAT_DFA_STATES * 2; i++) {
+        free(d->table[i]);
+        d->table[i] = NULL;
+    }
+    d->count = 0;
+    d->flushes++;
+    d->init[0] = d->init[1] = NULL;
+}
+
+void rxDfaInit(rxDfa *d, const regex *rx, int start, int unanchored) {
+    memset(d, 0, sizeof(*d));
+    d->rx = rx;
+    d->start = start;
+    d->unanchored = unanchored;
+    d->table = calloc(COPYCAT_DFA_STATES * 2, sizeof(rxDState *));
+    d->seeds = malloc((rx->nstates + 1) * sizeof(int));
+    d->set = malloc(rx->nstates * sizeof(int));
+    d->stack = malloc(rx->nstates * sizeof(int));
+    d->mark = calloc(rx->nstates, sizeof(unsigned));
+}
+
+void rxDfaFree(rxDfa *d) {
+    if (d->table == NULL) return;
+    rxDfaFlush(d);
+    free(d->table);
+    free(d->seeds);
+    free(d->set);
+    free(d->stack);
+    free(d->mark);
+    d->table = NULL;
+}
+
+int rxIntCmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+int rxClosure(rxDfa *d, const int *seeds, int nseeds, int atstart, int atend) {
+    // States reachable from seeds without consuming a byte, into d->set.
+    // Assertions that do not hold stay in the set, so that a state knows
+    // whether it matches should the text end there
+    const rxState *states = d->rx->states;
+    int n = 0, sp = 0, i;
+    if (++d->gen == 0) {
+        memset(d->mark, 0, d->rx->nstates * sizeof(unsigned));
+        d->gen = 1;
+    }
+    // States are marked as they are pushed, so the stack holds each once
+    for (i = 0; i < nseeds; i++) {
+        if (d->mark[seeds[i]] == d->gen) continue;
+        d->mark[seeds[i]] = d->gen;
+        d->stack[sp++] = seeds[i];
+    }
+    while (sp > 0) {
+        int s = d->stack[--sp];
+        const rxState *st = &states[s];
+        int out[2] = {-1, -1};
+        if (st->op == RX_SPLIT) {
+            out[0] = st->out1;
+            out[1] = st->out;
+        } else if ((st->op == RX_START && atstart) || (st->op == RX_END && atend)) {
+            out[0] = st->out;
+        } else {
+            d->set[n++] = s;
+        }
+        for (i = 0; i < 2; i++) {
+            if (out[i] < 0 || d->mark[out[i]] == d->gen) continue;
+            d->mark[out[i]] = d->gen;
+            d->stack[sp++] = out[i];
+        }
+    }
+    qsort(d->set, n, sizeof(int), rxIntCmp);
+    return n;
+}
+
+rxDState *rxIntern(rxDfa *d, int n, int atstart) {
+    // The DFA state for the set in d->set, built if it is not cached
+    uint32_t h = 2166136261u ^ atstart;
+    int i;
+    for (i = 0; i < n; i++) h = (h ^ d->set[i]) * 16777619u;
+    int mask = COPYCAT_DFA_STATES * 2 - 1;
+    int slot = h & mask;
+    rxDState *st;
+    while ((st = d->table[slot]) != NULL) {
+        if (st->n == n && st->atstart == atstart && memcmp(st->set, d->set, n * sizeof(int)) == 0)
+            return st;
+        slot = (slot + 1) & mask;
+    }
+    if (d->count == COPYCAT_DFA_STATES) {
+        rxDfaFlush(d);
+        slot = h & mask;
+    }
+    st = calloc(1, sizeof(rxDState) + n * sizeof(int));
+    st->atstart = atstart;
+    st->n = n;
+    memcpy(st->set, d->set, n * sizeof(int));
+    d->table[slot] = st;
+    d->count++;
+
+    // Matches now, or if the end of the text is reached here
+    const rxState *states = d->rx->states;
+    int nseeds = 0;
+    for (i = 0; i < n; i++) {
+        if (states[st->set[i]].op == RX_MATCH) st->match = 1;
+        if (states[st->set[i]].op != RX_CLASS) d->seeds[nseeds++] = st->set[i];
+    }
+    st->endmatch = st->match;
+    if (!st->match && nseeds > 0) {
+        n = rxClosure(d, d->seeds, nseeds, atstart, 1);
+        for (i = 0; i < n; i++)
+            if (states[d->set[i]].op == RX_MATCH) st->endmatch = 1;
+    }
+    return st;
+}
+
+rxDState *rxStartState(rxDfa *d, int atstart) {
+    if (d->init[atstart] == NULL) {
+        int n = rxClosure(d, &d->start, 1, atstart, 0);
+        d->init[atstart] = rxIntern(d, n, atstart);
+    }
+    return d->init[atstart];
+}
+
+rxDState *rxStep(rxDfa *d, rxDState *st, unsigned char c) {
+    if (st->next[c]) return st->next[c];
+    const rxState *states = d->rx->states;
+    int nseeds = 0, i;
+    for (i = 0; i < st->n; i++) {
+        const rxState *s = &states[st->set[i]];
+        if (s->op == RX_CLASS && rxClassHas(s->cls, c))
+            d->seeds[nseeds++] = s->out;
+    }
+    if (d->unanchored) d->seeds[nseeds++] = d->start;
+    int flushes = d->flushes;
+    rxDState *next = rxIntern(d, rxClosure(d, d->seeds, nseeds, 0, 0), 0);
+    if (d->flushes == flushes) st->next[c] = next;
+    return next;
+}
+
+void rxMatcherInit(rxMatcher *m, const regex *rx) {
+    m->rx = rx;
+    rxDfaInit(&m->find, rx, rx->start, 1);
+    rxDfaInit(&m->back, rx, rx->rstart, 1);
+    rxDfaInit(&m->end, rx, rx->start, 0);
+}
+
+void rxMatcherFree(rxMatcher *m) {
+    if (m->rx == NULL) return;
+    rxDfaFree(&m->find);
+    rxDfaFree(&m->back);
+    rxDfaFree(&m->end);
+    free(m->starts);
+    memset(m, 0, sizeof(*m));
+}
+
+int rxFind(rxMatcher *m, const char *s, int len, int from) {
+    // Does a match start at or after from
+    rxDfa *d = &m->find;
+    rxDState *st = rxStartState(d, from == 0);
+    int i;
+    for (i = from; i < len && !st->match; i++)
+        st = rxStep(d, st, s[i]);
+    return st->match || st->endmatch;
+}
+
+void rxStarts(rxMatcher *m, const char *s, int len, int from) {
+    // Sets m->starts[i] for every i in [from, len] where a match starts,
+    // by running the reversed program backwards from the end of the text
+    rxDfa *d = &m->back;
+    if (len + 1 > m->startscap) {
+        m->startscap = len + 1;
+        m->starts = realloc(m->starts, m->startscap);
+    }
+    rxDState *st = rxStartState(d, 1);
+    int i = len;
+    while (1) {
+        m->starts[i] = i == 0 ? st->endmatch : st->match;
+        if (i == from) break;
+        i--;
+        st = rxStep(d, st, s[i]);
+    }
+}
+
+int rxEnd(rxMatcher *m, const char *s, int len, int start) {
+    // End of the longest match starting at start, -1 if there is none
+    rxDfa *d = &m->end;
+    rxDState *st = rxStartState(d, start == 0);
+    int end = -1, i;
+    for (i = start; i < len && st->n > 0; i++) {
+        if (st->match) end = i;
+        st = rxStep(d, st, s[i]);
+    }
+    if (i == len ? st->endmatch : st->match) end = i;
+    return end;
+}
+
+int rxMatch(rxMatcher *m, const char *s, int len, int from, int *mlen) {
+    // Start of the leftmost-longest match at or after from, -1 if there
+    // is none; *mlen is set to its length
+    if (!rxFind(m, s, len, from)) return -1;
+    rxStarts(m, s, len, from);
+    int i;
+    for (i = from; i <= len; i++) {
+        if (!m->starts[i]) continue;
+        *mlen = rxEnd(m, s, len, i) - i;
+        return i;
+    }
+    return -1;
+}
+
+/*----- search index -----*/
+
+/*
+* With -i a trigram index of the file is built in the background once it
+* is open. Rows are grouped into blocks, original rows by about
+* COPYCAT_INDEX_BYTES of text and add rows by COPYCAT_INDEX_LINES lines,
+* and every block has a bitmap of the hashes of the trigrams in its rows.
+* A block can only hold a query if the bits of all of the query's
+* trigrams are set, so a search passes over the other blocks without
+* reading them. Candidates are still searched, which makes hash
+* collisions harmless.
+*
+* Edits only set bits, in the block of the add row they touch. A row that
+* is changed or deleted keeps its old bits, which costs some searching
+* and never a match.
+*/
+
+uint32_t trigramHash(uint32_t trigram) {
+    return (trigram * 2654435761u) >> (32 - COPYCAT_INDEX_HASH);
+}
+
+uint64_t *indexBlock(struct trigramBlocks *t, int b) {
+    // Bitmap of block b, added zeroed if it is new
+    if (b >= t->cap) {
+        int cap = t->cap ? t->cap : 16;
+        while (cap <= b) cap *= 2;
+        t->bits = realloc(t->bits, (size_t)cap * COPYCAT_INDEX_WORDS * sizeof(uint64_t));
+        t->first = realloc(t->first, cap * sizeof(int));
+        t->cap = cap;
+    }
+    while (t->nblocks <= b) {
+        memset(&t->bits[(size_t)t->nblocks * COPYCAT_INDEX_WORDS], 0,
+               COPYCAT_INDEX_WORDS * sizeof(uint64_t));
+        t->first[t->nblocks] = t->nblocks * COPYCAT_INDEX_LINES;
+        t->nblocks++;
+    }
+    return &t->bits[(size_t)b * COPYCAT_INDEX_WORDS];
+}
+
+void indexText(uint64_t *bits, const char *s, int len) {
+    uint32_t trigram = 0;
+    int i;
+    for (i = 0; i < len; i++) {
+        trigram = ((trigram << 8) | (unsigned char)s[i]) & 0xffffff;
+        if (i < 2) continue;
+        uint32_t h = trigramHash(trigram);
+        bits[h >> 6] |= 1ull << (h & 63);
+    }
+}
+
+void *indexBuild(void *arg) {
+    // Indexes the original rows, which no one changes
+    struct searchIndex *index = arg;
+    struct trigramBlocks *t = &index->orig;
+    long long start = editorClockMs();
+    int lines = E.pt.table[PT_ORIGINAL].len;
+    int line = E.pt.dropped, bytes = 0;
+    uint64_t *bits = NULL;
+    while (line < lines) {
+        if (bits == NULL || bytes >= COPYCAT_INDEX_BYTES) {
+            bits = indexBlock(t, t->nblocks);
+            t->first[t->nblocks - 1] = line;
+            bytes = 0;
+        }
+        erow *row = ptRow(PT_ORIGINAL, line++);
+        indexText(bits, row->chars, row->size);
+        bytes += row->size + 1;
+    }
+    pthread_mutex_lock(&index->lock);
+    index->ms = editorClockMs() - start;
+    index->ready = 1;
+    pthread_mutex_unlock(&index->lock);
+    editorWake();
+    return NULL;
+}
+
+void editorIndexStart() {
+    struct searchIndex *index = &E.index;
+    if (!index->enabled) return;
+    pthread_mutex_init(&index->lock, NULL);
+    if (pthread_create(&index->thread, NULL, indexBuild, index) != 0)
+        index->enabled = 0;
+}
+
+int editorIndexReady() {
+    // Once built the index stays built, the lock is only needed until then
+    struct searchIndex *index = &E.index;
+    if (!index->enabled) return 0;
+    if (index->built) return 1;
+    pthread_mutex_lock(&index->lock);
+    index->built = index->ready;
+    pthread_mutex_unlock(&index->lock);
+    return index->built;
+}
+
+void editorIndexLine(int line, erow *row) {
+    // Adds the trigrams of add row line
+    if (!E.index.enabled) return;
+    indexText(indexBlock(&E.index.add, line / COPYCAT_INDEX_LINES), row->chars, row->size);
+}
+
+void editorIndexRow(erow *row) {
+    if (E.index.enabled && row->owned)
+        editorIndexLine(row->line, row);
+}
+
+int indexBlockHas(const struct trigramBlocks *t, int b, const struct indexQuery *q) {
+    const uint64_t *bits = &t->bits[(size_t)b * COPYCAT_INDEX_WORDS];
+    int i;
+    for (i = 0; i < q->n; i++)
+        if (!(bits[q->hash[i] >> 6] & (1ull << (q->hash[i] & 63)))) return 0;
+    return 1;
+}
+
+int indexQueryInit(struct indexQuery *q, const char *query, size_t len) {
+    // Hashes of the trigrams of query, returns 0 if there are none, if
+    // there is no index to look them up in, or if most blocks hold them
+    // and looking them up would only slow the search down
+    q->n = 0;
+    q->orig = editorIndexReady();
+    if (!E.index.enabled || len < 3) return 0;
+    uint32_t trigram = 0;
+    size_t i;
+    for (i = 0; i < len && q->n < COPYCAT_INDEX_QUERY; i++) {
+        trigram = ((trigram << 8) | (unsigned char)query[i]) & 0xffffff;
+        if (i >= 2) q->hash[q->n++] = trigramHash(trigram);
+    }
+
+    // Find next asks again for every match, the answer for the last
+    // query is kept
+    const struct trigramBlocks *t = &E.index.orig;
+    struct indexQuery *last = &E.index.last;
+    if (q->orig && t->nblocks > 0) {
+        if (!last->orig || last->n != q->n || memcmp(last->hash, q->hash, q->n * sizeof(uint32_t))) {
+            int step = t->nblocks / COPYCAT_INDEX_SAMPLE + 1;
+            int b, sampled = 0, hits = 0;
+            for (b = 0; b < t->nblocks; b += step) {
+                sampled++;
+                hits += indexBlockHas(t, b, q);
+            }
+            *last = *q;
+            E.index.common = hits * 100 >= sampled * COPYCAT_INDEX_COMMON;
+        }
+        if (E.index.common) {
+            q->n = 0;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int indexNextRun(const struct indexQuery *q, int buf, int line, int end, int *runend) {
+    // First line in [line, end) of buf whose block may hold the query,
+    // with *runend set to the end of the run of such blocks; end if none.
+    // Runs are cut at COPYCAT_INDEX_RUN blocks, so that a search that
+    // stops at its first match does not look at every block
+    *runend = end;
+    if (q == NULL || q->n == 0 || (buf == PT_ORIGINAL && !q->orig)) return line;
+    const struct trigramBlocks *t = buf == PT_ORIGINAL ? &E.index.orig : &E.index.add;
+
+    // Block of line
+    int lo = 0, hi = t->nblocks - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (t->first[mid] <= line) lo = mid;
+        else hi = mid - 1;
+    }
+    int b;
+    for (b = lo; b < t->nblocks && t->first[b] < end; b++) {
+        if (!indexBlockHas(t, b, q)) continue;
+        int start = t->first[b] > line ? t->first[b] : line;
+        int last = b + COPYCAT_INDEX_RUN - 1;
+        while (b < last && b + 1 < t->nblocks && t->first[b + 1] < end &&
+               indexBlockHas(t, b + 1, q))
+            b++;
+        if (b + 1 < t->nblocks && t->first[b + 1] < end) *runend = t->first[b + 1];
+        else if (buf == PT_ADD && (b + 1) * COPYCAT_INDEX_LINES < end)
+            *runend = (b + 1) * COPYCAT_INDEX_LINES;
+        return start;
+    }
+    // Add rows past the last block have not been indexed
+    if (buf == PT_ADD && t->nblocks * COPYCAT_INDEX_LINES < end) {
+        int start = t->nblocks * COPYCAT_INDEX_LINES;
+        return start > line ? start : line;
+    }
+    return end;
+}
+
+/*----- Find --------------*/
+
+char *searchMem(const char *hay, size_t n, const char *needle, size_t m) {
+    /*
+    * memmem() that looks at many positions at once: a position is only
+    * compared in full when both its first and its last byte match the
+    * needle, which rules out nearly all of them in two vector compares.
+    * 32 positions a step with AVX2, 16 with SSE2, memmem() otherwise.
+    */
+    if (m == 0) return (char *)hay;
+    if (m > n) return NULL;
+    if (m == 1) return memchr(hay, needle[0], n);
+    size_t i = 0;
+
+#ifdef __AVX2__
+    const __m256i first32 = _mm256_set1_epi8(needle[0]);
+    const __m256i last32 = _mm256_set1_epi8(needle[m - 1]);
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+        unsigned int mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first32), _mm256_cmpeq_epi8(b, last32)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+                return (char *)hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        unsigned int mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+                return (char *)hay + i + bit;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    return memmem(hay + i, n - i, needle, m);
+}
+
+int ptLineOf(int start, int count, const char *p) {
+    // Original line among [start, start + count) whose text holds p.
+    // Galloping first, as matches tend to be close to where the search
+    // started
+    int lo = start, hi = start + count - 1;
+    int step = 1;
+    while (lo + step <= hi && ptRow(PT_ORIGINAL, lo + step)->chars <= p) {
+        lo += step;
+        step *= 2;
+    }
+    if (lo + step - 1 < hi) hi = lo + step - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (ptRow(PT_ORIGINAL, mid)->chars <= p) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+int editorSearchRows(const char *query, size_t len, int from, int to, int *col) {
+    /*
+    * First row in [from, to) that contains query, which holds no line
+    * breaks; *col is set to where it starts. Runs of original rows are
+    * consecutive in the file, so each is searched as one stream rather
+    * than row by row. With an index only the runs of blocks that may
+    * hold query are searched. Returns -1 if there is no match.
+    */
+    struct indexQuery q;
+    int indexed = indexQueryInit(&q, query, len);
+    int at = from;
+    while (at < to) {
+        int off;
+        ptNode *n = ptFind(at, &off);
+        if (n == NULL) break;
+        int count = n->count - off;
+        if (count > to - at) count = to - at;
+
+        int first = n->start + off, end = first + count, line, runend;
+        for (line = indexNextRun(indexed ? &q : NULL, n->buf, first, end, &runend);
+             line < end;
+             line = indexNextRun(indexed ? &q : NULL, n->buf, runend, end, &runend)) {
+            if (n->buf == PT_ORIGINAL) {
+                erow *row = ptRow(PT_ORIGINAL, line);
+                erow *last = ptRow(PT_ORIGINAL, runend - 1);
+                char *match = searchMem(row->chars, last->chars + last->size - row->chars,
+                                        query, len);
+                if (match) {
+                    line = ptLineOf(line, runend - line, match);
+                    *col = match - ptRow(PT_ORIGINAL, line)->chars;
+                    return at + line - first;
+                }
+            } else {
+                for (; line < runend; line++) {
+                    erow *row = ptRow(PT_ADD, line);
+                    char *match = searchMem(row->chars, row->size, query, len);
+                    if (match) {
+                        *col = match - row->chars;
+                        return at + line - first;
+                    }
+                }
+            }
+        }
+        at += count;
+    }
+    return -1;
+}
+
+int editorSearchRowsRegex(rxMatcher *m, int from, int to, int *col, int *mlen) {
+    // editorSearchRows() for a regular expression. Rows without the
+    // literal prefix of the pattern are passed over by searchMem()
+    const regex *rx = m->rx;
+    struct indexQuery q;
+    int indexed = indexQueryInit(&q, rx->prefix, rx->prefixlen);
+    int at = from;
+    while (at < to) {
+        int off;
+        ptNode *n = ptFind(at, &off);
+        if (n == NULL) break;
+        int count = n->count - off;
+        if (count > to - at) count = to - at;
+
+        int first = n->start + off, end = first + count, line, runend;
+        for (line = indexNextRun(indexed ? &q : NULL, n->buf, first, end, &runend);
+             line < end;
+             line = indexNextRun(indexed ? &q : NULL, n->buf, runend, end, &runend)) {
+            while (line < runend) {
+                // The rest of the run for original rows, else one row
+                erow *row = ptRow(n->buf, line);
+                erow *last = n->buf == PT_ORIGINAL ? ptRow(PT_ORIGINAL, runend - 1) : row;
+                char *p = searchMem(row->chars, last->chars + last->size - row->chars,
+                                    rx->prefix, rx->prefixlen);
+                if (p == NULL) {
+                    line = n->buf == PT_ORIGINAL ? runend : line + 1;
+                    continue;
+                }
+                if (n->buf == PT_ORIGINAL) {
+                    line = ptLineOf(line, runend - line, p);
+                    row = ptRow(PT_ORIGINAL, line);
+                }
+                *col = rxMatch(m, row->chars, row->size, 0, mlen);
+                if (*col >= 0) return at + line - first;
+                line++;
+            }
+        }
+        at += count;
+    }
+    return -1;
+}
+
+/*
+* Counting and listing every match is done by a pool of worker threads.
+* editorSearchStart() cuts the document into chunks of about
+* COPYCAT_SEARCH_CHUNK bytes, the workers search them in any order and
+* wake the event loop as each one finishes, and editorSearchCollect()
+* appends finished chunks to E.search.matches in document order. The
+* list is complete up to the first unfinished chunk, so results are
+* usable while the search is still running. The document must not change
+* while a search runs, editorSearchStop() ends it.
+*/
+
+void searchChunkAdd(struct searchChunk *c, int at, erow *row, int col, int len) {
+    if (c->nmatches == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->matches = realloc(c->matches, c->cap * sizeof(searchMatch));
+    }
+    searchMatch *match = &c->matches[c->nmatches++];
+    match->row = at;
+    match->col = col;
+    match->len = len;
+
+    if (c->nrows > 0 && c->rows[c->nrows - 1].row == at) return;
+    if (c->nrows == c->rowcap) {
+        c->rowcap = c->rowcap ? c->rowcap * 2 : 64;
+        c->rows = realloc(c->rows, c->rowcap * sizeof(searchRow));
+    }
+    c->rows[c->nrows].row = at;
+    c->rows[c->nrows].e = row;
+    c->nrows++;
+}
+
+void searchChunkRow(struct searchChunk *c, int at, erow *row, const char *match,
+                    const char *query, size_t len, rxMatcher *m) {
+    // Every match on a row where query was found at match
+    if (m == NULL) {
+        while (match) {
+            searchChunkAdd(c, at, row, match - row->chars, len);
+            match += len;
+            match = searchMem(match, row->chars + row->size - match, query, len);
+        }
+    } else if (rxFind(m, row->chars, row->size, 0)) {
+        rxStarts(m, row->chars, row->size, 0);
+        int col = 0;
+        while (col <= row->size) {
+            if (!m->starts[col]) {
+                col++;
+                continue;
+            }
+            int end = rxEnd(m, row->chars, row->size, col);
+            searchChunkAdd(c, at, row, col, end - col);
+            col = end > col ? end : col + 1;
+        }
+    }
+}
+
+void searchChunkRun(struct searchChunk *c, const char *query, size_t len, rxMatcher *m) {
+    /*
+    * Every match in the chunk, without overlaps. query is found first,
+    * in one stream for original rows, and then the row it is on is
+    * searched in full; for a regular expression query is its prefix.
+    */
+    int j;
+    for (j = 0; j < c->ncands; j++) {
+        erow *row = c->cands[j].e;
+        const char *match = searchMem(row->chars, row->size, query, len);
+        if (match) searchChunkRow(c, c->cands[j].row, row, match, query, len, m);
+    }
+
+    j = 0;
+    while (j < c->count) {
+        int line = c->line + j;
+        erow *row = ptRow(c->buf, line);
+        const char *end = row->chars + row->size;
+        if (c->buf == PT_ORIGINAL) {
+            erow *last = ptRow(PT_ORIGINAL, c->line + c->count - 1);
+            end = last->chars + last->size;
+        }
+        const char *match = searchMem(row->chars, end - row->chars, query, len);
+        if (match == NULL && c->buf == PT_ORIGINAL) break;
+        if (match && c->buf == PT_ORIGINAL) {
+            line = ptLineOf(line, c->line + c->count - line, match);
+            row = ptRow(PT_ORIGINAL, line);
+        }
+        j = line - c->line + 1;
+        if (match) searchChunkRow(c, c->row + line - c->line, row, match, query, len, m);
+    }
+}
+
+void *searchWorker(void *arg) {
+    struct searchPool *pool = arg;
+    rxMatcher m;
+    int job = -1;
+    memset(&m, 0, sizeof(m));
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->next >= pool->nchunks)
+            pthread_cond_wait(&pool->work, &pool->lock);
+        struct searchChunk *c = &pool->chunks[pool->next++];
+        pool->running++;
+        if (pool->rx && job != pool->job) {
+            // Each thread builds its own DFAs
+            rxMatcherFree(&m);
+            rxMatcherInit(&m, pool->rx);
+            job = pool->job;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        searchChunkRun(c, pool->query, pool->len, pool->rx ? &m : NULL);
+
+        pthread_mutex_lock(&pool->lock);
+        c->done = 1;
+        pool->running--;
+        pool->finished++;
+        pthread_cond_broadcast(&pool->done);
+        editorWake();
+    }
+    return NULL;
+}
+
+int editorSearchComplete() {
+    return E.search.merged == E.search.nchunks;
+}
+
+// Rows below this have all of their matches in the list
+int editorSearchKnownRows() {
+    struct searchPool *pool = &E.search;
+    return editorSearchComplete() ? E.numrows : pool->chunks[pool->merged].row;
+}
+
+void editorSearchStop() {
+    // Waits for the chunks being searched and drops the results
+    struct searchPool *pool = &E.search;
+    pool->error = NULL;
+    if (!pool->active) return;
+    pthread_mutex_lock(&pool->lock);
+    pool->next = pool->nchunks;
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    int i;
+    for (i = 0; i < pool->nchunks; i++) {
+        free(pool->chunks[i].matches);
+        free(pool->chunks[i].rows);
+    }
+    free(pool->chunks);
+    free(pool->query);
+    free(pool->cands);
+    pool->cands = NULL;
+    pool->ncands = pool->narrowed = 0;
+    rxMatcherFree(&pool->matcher);
+    rxFree(pool->rx);
+    pool->rx = NULL;
+    pool->chunks = NULL;
+    pool->nchunks = pool->next = pool->finished = 0;
+    pthread_mutex_unlock(&pool->lock);
+
+    pool->active = 0;
+    pool->nmatches = pool->merged = pool->total = pool->nrows = 0;
+}
+
+void searchAddChunk(struct searchChunk **chunks, int *n, int row, int buf, int line, int count) {
+    if ((*n & (*n - 1)) == 0)
+        *chunks = realloc(*chunks, (*n ? *n * 2 : 1) * sizeof(struct searchChunk));
+    struct searchChunk *c = &(*chunks)[(*n)++];
+    memset(c, 0, sizeof(*c));
+    c->row = row;
+    c->buf = buf;
+    c->line = line;
+    c->count = count;
+}
+
+void editorSearchStart(const char *query) {
+    /*
+    * A query that contains the previous one can only match on rows that
+    * matched before, so when it is text like the previous one, only those
+    * rows are searched again, along with the rows the previous search had
+    * not got to yet. Visiting rows one by one is slower than streaming
+    * through them, so that is only done when few rows matched.
+    */
+    struct searchPool *pool = &E.search;
+    searchRow *cands = NULL;
+    int ncands = 0, from = 0, narrowed = 0;
+    if (pool->active && pool->rx == NULL && !pool->regex &&
+        pool->len > 0 && strstr(query, pool->query)) {
+        editorSearchCollect();
+        from = editorSearchKnownRows();
+        if (pool->nrows < from / 4) {
+            cands = pool->rows;
+            ncands = pool->nrows;
+            pool->rows = NULL;
+            pool->rowcap = 0;
+            narrowed = 1;
+        } else {
+            from = 0;
+        }
+    }
+    editorSearchStop();
+    pool->error = NULL;
+    regex *rx = NULL;
+    if (pool->regex && (rx = rxCompile(query, &pool->error)) == NULL)
+        return;
+    if (pool->nthreads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->work, NULL);
+        pthread_cond_init(&pool->done, NULL);
+        while (pool->nthreads < COPYCAT_SEARCH_THREADS && pool->nthreads < cpus &&
+               pthread_create(&pool->threads[pool->nthreads], NULL, searchWorker, pool) == 0)
+            pool->nthreads++;
+        if (pool->nthreads == 0) die("pthread_create");
+    }
+
+    // Chunks of about COPYCAT_SEARCH_CHUNK bytes; original rows are cut
+    // by position in the file, add rows by count
+    struct searchChunk *chunks = NULL;
+    int nchunks = 0;
+    int i, bytes = 0, first = 0;
+    for (i = 0; i < ncands; i++) {
+        bytes += cands[i].e->size + 1;
+        if (bytes < COPYCAT_SEARCH_CHUNK && i + 1 < ncands) continue;
+        searchAddChunk(&chunks, &nchunks, cands[first].row, PT_ORIGINAL, 0, 0);
+        chunks[nchunks - 1].cands = &cands[first];
+        chunks[nchunks - 1].ncands = i + 1 - first;
+        first = i + 1;
+        bytes = 0;
+    }
+    // With an index, only blocks that may hold query are cut into chunks
+    struct indexQuery q;
+    int indexed = rx ? indexQueryInit(&q, rx->prefix, rx->prefixlen)
+                     : indexQueryInit(&q, query, strlen(query));
+    int at = from;
+    while (at < E.numrows) {
+        int off;
+        ptNode *n = ptFind(at, &off);
+        int first = n->start + off, end = n->start + n->count, line, runend;
+        for (line = indexNextRun(indexed ? &q : NULL, n->buf, first, end, &runend);
+             line < end;
+             line = indexNextRun(indexed ? &q : NULL, n->buf, runend, end, &runend)) {
+            while (line < runend) {
+                int count;
+                if (n->buf == PT_ORIGINAL) {
+                    const char *limit = ptRow(PT_ORIGINAL, line)->chars + COPYCAT_SEARCH_CHUNK;
+                    count = ptLineOf(line, runend - line, limit) - line + 1;
+                } else {
+                    count = COPYCAT_SEARCH_CHUNK / 64;
+                    if (count > runend - line) count = runend - line;
+                }
+                searchAddChunk(&chunks, &nchunks, at + line - first, n->buf, line, count);
+                line += count;
+            }
+        }
+        at += end - first;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (rx) {
+        pool->query = malloc(rx->prefixlen + 1);
+        memcpy(pool->query, rx->prefix, rx->prefixlen);
+        pool->len = rx->prefixlen;
+        rxMatcherInit(&pool->matcher, rx);
+    } else {
+        pool->query = strdup(query);
+        pool->len = strlen(query);
+    }
+    pool->rx = rx;
+    pool->narrowed = narrowed;
+    pool->cands = cands;
+    pool->ncands = ncands;
+    pool->rest = from;
+    pool->job++;
+    pool->chunks = chunks;
+    pool->nchunks = nchunks;
+    pool->next = 0;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    pool->active = 1;
+}
+
+void editorSearchCollect() {
+    // Moves the matches of chunks that finished in order to the list
+    struct searchPool *pool = &E.search;
+    if (!pool->active) return;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->merged < pool->nchunks && pool->chunks[pool->merged].done) {
+        struct searchChunk *c = &pool->chunks[pool->merged++];
+        if (pool->nmatches + c->nmatches > pool->cap) {
+            pool->cap = (pool->nmatches + c->nmatches) * 2;
+            pool->matches = realloc(pool->matches, pool->cap * sizeof(searchMatch));
+        }
+        if (c->nmatches)
+            memcpy(&pool->matches[pool->nmatches], c->matches, c->nmatches * sizeof(searchMatch));
+        pool->nmatches += c->nmatches;
+        if (pool->nrows + c->nrows > pool->rowcap) {
+            pool->rowcap = (pool->nrows + c->nrows) * 2;
+            pool->rows = realloc(pool->rows, pool->rowcap * sizeof(searchRow));
+        }
+        if (c->nrows)
+            memcpy(&pool->rows[pool->nrows], c->rows, c->nrows * sizeof(searchRow));
+        pool->nrows += c->nrows;
+    }
+    int i;
+    pool->total = pool->nmatches;
+    for (i = pool->merged; i < pool->nchunks; i++)
+        if (pool->chunks[i].done) pool->total += pool->chunks[i].nmatches;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void editorSearchWait() {
+    // Blocks until every chunk has been searched
+    struct searchPool *pool = &E.search;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->finished < pool->nchunks)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    editorSearchCollect();
+}
+
+// Index of the first listed match at or after (row, col)
+int editorSearchIndex(int row, int col) {
+    int lo = 0, hi = E.search.nmatches;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        searchMatch *m = &E.search.matches[mid];
+        if (m->row < row || (m->row == row && m->col < col)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int editorSearchNarrowed(const char *query, int *col, int *mlen) {
+    // First match of a search narrowed from the previous query
+    struct searchPool *pool = &E.search;
+    *mlen = strlen(query);
+    int i;
+    for (i = 0; i < pool->ncands; i++) {
+        erow *row = pool->cands[i].e;
+        char *match = searchMem(row->chars, row->size, query, *mlen);
+        if (match) {
+            *col = match - row->chars;
+            return pool->cands[i].row;
+        }
+    }
+    return editorSearchRows(query, *mlen, pool->rest, E.numrows, col);
+}
+
+int editorSearchFrom(const char *query, int from, int to, int *col, int *mlen) {
+    // First match in rows [from, to) as a regular expression or as text
+    if (E.search.regex)
+        return editorSearchRowsRegex(&E.search.matcher, from, to, col, mlen);
+    *mlen = strlen(query);
+    return editorSearchRows(query, *mlen, from, to, col);
+}
+
+void editorFindCallback(char *query, int key) {
+    static int last_match = -1;
+    static int last_col = 0;
+    static int direction = 1;
+
+    static int saved_hl_line;
+    static char *saved_hl = NULL;
+
+    if (saved_hl) {
+        erow *row = editorRowRender(editorRowAt(saved_hl_line));
+        memcpy(row->hl, saved_hl, row->rsize);
+        free(saved_hl);
+        saved_hl = NULL;
+    }
+
+    if (key == '\r' || key == '\x1b') {
+        last_match = -1;
+        direction = -1;
+        editorSearchStop();
+        return;
+    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+        direction = 1;
+    } else if (key == ARROW_LEFT || key == ARROW_UP) {
+        direction = -1;
+    } else {
+        if (key == CTRL_KEY('t')) E.search.regex = !E.search.regex;
+        last_match = -1;
+        direction = 1;
+        if (query[0]) editorSearchStart(query);
+        else editorSearchStop();
+    }
+
+
+    if (last_match == -1) direction = 1;
+    // Nothing to search for with a pattern that did not compile
+    if (E.search.regex && !E.search.active) return;
+    int current = -1, col = 0, len = 0;
+
+    // Step through the match list where the workers have filled it in,
+    // that also finds further matches on the same row
+    int i = -1;
+    if (last_match != -1 && E.search.active) {
+        searchMatch *m = E.search.matches;
+        if (direction == 1) {
+            i = editorSearchIndex(last_match, last_col + 1);
+            if (i == E.search.nmatches)
+                i = (editorSearchComplete() && i > 0) ? 0 : -1;
+        } else {
+            i = editorSearchIndex(last_match, last_col) - 1;
+            if (i < 0 && editorSearchComplete() && E.search.nmatches > 0)
+                i = E.search.nmatches - 1;
+        }
+        if (i >= 0) {
+            current = m[i].row;
+            col = m[i].col;
+            len = m[i].len;
+        }
+    }
+
+    if (i >= 0) {
+        // Found in the list
+    } else if (last_match == -1 && E.search.narrowed) {
+        current = editorSearchNarrowed(query, &col, &len);
+    } else if (direction == 1) {
+        // Searched in the raw rows, so rows that are not on screen never
+        // need to be rendered
+        current = editorSearchFrom(query, last_match + 1, E.numrows, &col, &len);
+        if (current == -1)
+            current = editorSearchFrom(query, 0, last_match + 1, &col, &len);
+    } else {
+        int i;
+        for (i = 1; i <= E.numrows && current == -1; i++) {
+            int at = ((last_match - i) % E.numrows + E.numrows) % E.numrows;
+            if (editorSearchFrom(query, at, at + 1, &col, &len) == at)
+                current = at;
+        }
+    }
+
+    if (current != -1) {
+        erow *row = editorRowAt(current);
+        last_match = current;
+        last_col = col;
+        E.cy = current;
+        E.cx = col;
+        E.rowoff = E.numrows;
+
+        editorRowRender(row);
+        saved_hl_line = current;
+        saved_hl = malloc(row->rsize);
+        memcpy(saved_hl, row->hl, row->rsize);
+
+        int rx = editorRowCxToRx(row, E.cx);
+        memset(&row->hl[rx], HL_MATCH, editorRowCxToRx(row, E.cx + len) - rx);
+    }
+}
+
+void editorFind() {
+    int saved_cx = E.cx, saved_cy = E.cy;
+    int saved_colloff = E.coloff, saved_rowoff = E.rowoff;
+
+    char *query = editorPrompt("Search: \x1b[5m%s\x1b[25m (Use ESC/ARROW/ENTER, ^T regex)", editorFindCallback);
+    if (query == NULL)
+        free(query);
+    else {
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.coloff = saved_colloff;
+        E.rowoff = saved_rowoff;
+    }
+}
+
+/*
+* Replace all finds every match with the worker pool, then builds the new
+* text of each matching row in a single allocation, split across the same
+* number of threads. The new rows go into the add buffer one after
+* another, and the piece tree is rebuilt once around them. The new rows
+* are neither rendered nor lexed until they are drawn.
+*/
+
+struct replaceRow {
+    int row;
+    erow *e;
+    const searchMatch *matches;
+    int nmatches;
+    char *chars;    // The new text
+    int size;
+};
+
+struct replaceJob {
+    struct replaceRow *rows;
+    int nrows;
+    const char *with;
+    int len;
+};
+
+void *replaceWorker(void *arg) {
+    struct replaceJob *job = arg;
+    int i, j;
+    for (i = 0; i < job->nrows; i++) {
+        struct replaceRow *r = &job->rows[i];
+        int size = r->e->size;
+        for (j = 0; j < r->nmatches; j++)
+            size += job->len - r->matches[j].len;
+        char *p = r->chars = malloc(size + 1);
+        int from = 0;
+        for (j = 0; j < r->nmatches; j++) {
+            const searchMatch *m = &r->matches[j];
+            memcpy(p, &r->e->chars[from], m->col - from);
+            p += m->col - from;
+            memcpy(p, job->with, job->len);
+            p += job->len;
+            from = m->col + m->len;
+        }
+        memcpy(p, &r->e->chars[from], r->e->size - from);
+        r->chars[size] = '\0';
+        r->size = size;
+    }
+    return NULL;
+}
+
+int editorReplaceAll(const char *query, const char *with) {
+    // Returns the number of matches replaced, -1 if query does not compile
+    editorSearchStart(query);
+    if (!E.search.active) return -1;
+    editorSearchWait();
+
+    int nrows = E.search.nrows, nmatches = E.search.nmatches, i, m = 0;
+    struct replaceRow *rows = malloc(nrows * sizeof(struct replaceRow));
+    for (i = 0; i < nrows; i++) {
+        rows[i].row = E.search.rows[i].row;
+        rows[i].e = E.search.rows[i].e;
+        rows[i].matches = &E.search.matches[m];
+        while (m < nmatches && E.search.matches[m].row == rows[i].row) m++;
+        rows[i].nmatches = &E.search.matches[m] - rows[i].matches;
+    }
+
+    // An even share of the rows for each thread
+    int nthreads = E.search.nthreads;
+    struct replaceJob jobs[COPYCAT_SEARCH_THREADS];
+    pthread_t threads[COPYCAT_SEARCH_THREADS];
+    int started[COPYCAT_SEARCH_THREADS];
+    for (i = 0; i < nthreads; i++) {
+        int first = (long long)nrows * i / nthreads;
+        jobs[i].rows = &rows[first];
+        jobs[i].nrows = (long long)nrows * (i + 1) / nthreads - first;
+        jobs[i].with = with;
+        jobs[i].len = strlen(with);
+        started[i] = i > 0 && pthread_create(&threads[i], NULL, replaceWorker, &jobs[i]) == 0;
+    }
+    for (i = 0; i < nthreads; i++)
+        if (!started[i]) replaceWorker(&jobs[i]);
+    for (i = 0; i < nthreads; i++)
+        if (started[i]) pthread_join(threads[i], NULL);
+    editorSearchStop();
+
+    // New rows in the add buffer, in place of the old ones. Every match
+    // goes into the journal, all of them one undo step.
+    int line = E.pt.table[PT_ADD].len;
+    int *at = malloc(nrows * sizeof(int));
+    int len = strlen(with), j;
+    for (i = 0; i < nrows; i++) {
+        int shift = 0;
+        for (j = 0; j < rows[i].nmatches; j++) {
+            const searchMatch *mt = &rows[i].matches[j];
+            undoAdd(i == 0 && j == 0, rows[i].row, mt->col + shift,
+                    &rows[i].e->chars[mt->col], mt->len, with, len);
+            shift += len - mt->len;
+        }
+
+        int l = ptNewRow(PT_ADD);
+        erow *row = ptRow(PT_ADD, l);
+        row->chars = rows[i].chars;
+        row->size = rows[i].size;
+        row->owned = 1;
+        row->hl_in = -1;
+        editorIndexLine(l, row);
+        editorFreeRow(rows[i].e);
+        at[i] = rows[i].row;
+    }
+    if (nrows > 0) {
+        ptReplaceRows(at, nrows, line);
+        editorSyntaxInvalidate(at[0]);
+        E.dirty++;
+    }
+    free(at);
+    free(rows);
+
+    erow *row = editorRowAt(E.cy);
+    if (row && E.cx > row->size) E.cx = row->size;
+    return nmatches;
+}
+
+// The prompt of editorReplace(), which says whether it takes a regex
+char replacePrompt[64];
+
+void editorReplaceCallback(char *query, int key) {
+    (void)query;
+    if (key == CTRL_KEY('t')) E.search.regex = !E.search.regex;
+    snprintf(replacePrompt, sizeof(replacePrompt), "Replace%s: %%s (^T regex, ESC to cancel)",
+             E.search.regex ? " regex" : "");
+}
+
+void editorReplace() {
+    editorReplaceCallback("", 0);
+    char *query = editorPrompt(replacePrompt, editorReplaceCallback);
+    if (query == NULL) return;
+    char *with = editorPrompt("Replace with: %s (ESC to cancel)", NULL);
+    if (with) {
+        long long start = editorClockMs();
+        int n = editorReplaceAll(query, with);
+        if (n < 0)
+            editorSetStatusMessage("Bad regex: %s", E.search.error);
+        else
+            editorSetStatusMessage("Replaced %d occurrences in %lld ms%s", n, editorClockMs() - start,
+                                   E.undo.skip ? ", too many to undo" : "");
+        E.search.error = NULL;
+    }
+    free(query);
+    free(with);
+}
+
+
+/*----- append buffer -----*/
+
+// Makes room for len more bytes, doubling the buffer as it fills up
+int abGrow(struct abuf *ab, int len){
+    if (ab->len + len <= ab->cap)
+        return 0;
+    int cap = ab->cap ? ab->cap : 1024;
+    while (cap < ab->len + len)
+        cap *= 2;
+    char *new = realloc(ab->b, cap);
+    if (new == NULL){
+        return -1;
+    }
+    ab->b = new;
+    ab->cap = cap;
+    return 0;
+}
+
+// Appends len bytes left for the caller to fill in
+char *abReserve(struct abuf *ab, int len){
+    if (abGrow(ab, len) == -1)
+        return NULL;
+    ab->len += len;
+    return &ab->b[ab->len - len];
+}
+
+void abAppend(struct abuf *ab, const char *s, int len){
+    char *p = abReserve(ab, len);
+    if (p == NULL){
+        return;
+    }
+    memcpy(p, s, len);
+}
+
+void abFree(struct abuf *ab){
+    free(ab->b);
+}
+
+/*----- screen -----*/
+
+/*
+* Frames are drawn into E.frame, a grid of cells, and screenFlush() sends
+* the terminal only the cells that differ from E.shadow, the grid it
+* already shows. A keystroke then costs a few cursor moves and the
+* changed characters instead of a full repaint.
+*/
+
+void screenResize() {
+    size_t n = (size_t)(E.screenrows + 2) * E.screencols;
+    free(E.frame);
+    free(E.shadow);
+    E.frame = malloc(n * sizeof(cell));
+    E.shadow = malloc(n * sizeof(cell));
+    if (E.frame == NULL || E.shadow == NULL) die("malloc");
+    E.framerows = E.screenrows + 2;
+    E.framecols = E.screencols;
+    E.repaint = 1;
+    // Room for a full repaint
+    abGrow(&E.out, (int)(n * 2));
+}
+
+// SGR sequence selecting each pen, see screenCompilePens()
+char pen_sgr[CELL_PENS][24];
+unsigned char pen_sgr_len[CELL_PENS];
+
+cell *screenRow(int y) {
+    return &E.frame[(size_t)y * E.framecols];
+}
+
+int cellSamePen(const cell *a, const cell *b) {
+    return a->fg == b->fg && a->bg == b->bg && a->style == b->style;
+}
+
+int cellEqual(const cell *a, const cell *b) {
+    return memcmp(a, b, sizeof(cell)) == 0;
+}
 
+int cellBlank(const cell *c) {
+    const cell blank = {' ', FG_DEFAULT, BG_DEFAULT, 0};
+    return cellEqual(c, &blank);
+}
 
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-    int i;
-    for (i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
-
-        erow *row = &E.row[current];
-        // strstr : Check for a substring
-        char *match = strstr(row->renders, query);
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->renders);
-            E.rowoff = E.numrows;
+// Writes len characters of s from column x of row y, returns the column after them
+int screenPut(int y, int x, const char *s, int len, cell pen) {
+    cell *c = screenRow(y);
+    int j;
+    for (j = 0; j < len && x < E.framecols; j++, x++) {
+        pen.ch = s[j];
+        c[x] = pen;
+    }
+    return x;
+}
 
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
+// Blanks row y from column x to the end
+void screenClear(int y, int x) {
+    cell blank = {' ', FG_DEFAULT, BG_DEFAULT, 0};
+    cell *c = screenRow(y);
+    for (; x < E.framecols; x++)
+        c[x] = blank;
+}
 
-            memset(&row->hl[match - row->renders], HL_MATCH, strlen(query));
-            break;
+// Applies the SGR sequence whose parameters start at s, returns the end of it
+const char *screenParseSgr(const char *s, cell *pen) {
+    const char *end = s;
+    while (*end && (*end < 0x40 || *end > 0x7e))
+        end++;
+    if (*end != 'm')
+        return *end ? end + 1 : end;
+    while (s <= end) {
+        int n = 0;
+        while (isdigit((unsigned char)*s))
+            n = n * 10 + (*s++ - '0');
+        if (n == 0) {
+            pen->fg = FG_DEFAULT;
+            pen->bg = BG_DEFAULT;
+            pen->style = 0;
+        } else if (n == BOLD) {
+            pen->style |= CELL_BOLD;
+        } else if (n == BLINK) {
+            pen->style |= CELL_BLINK;
+        } else if (n == 7) {
+            pen->style |= CELL_INVERSE;
+        } else if (n == BOLD_OFF) {
+            pen->style &= ~CELL_BOLD;
+        } else if (n == BLINK_OFF) {
+            pen->style &= ~CELL_BLINK;
+        } else if (n == 27) {
+            pen->style &= ~CELL_INVERSE;
+        } else if ((n >= FG_BLACK && n <= FG_WHITE) || n == FG_DEFAULT) {
+            pen->fg = n;
+        } else if ((n >= BG_BLACK && n <= BG_WHITE) || n == BG_DEFAULT) {
+            pen->bg = n;
         }
+        s++;    // ';' or the final 'm'
     }
+    return end + 1;
 }
 
-void editorFind() {
-    int saved_cx = E.cx, saved_cy = E.cy;
-    int saved_colloff = E.coloff, saved_rowoff = E.rowoff;
+int cellPen(const cell *c) {
+    return (c->style * 10 + (c->fg - FG_BLACK)) * 10 + (c->bg - BG_BLACK);
+}
 
-    char *query = editorPrompt("Search: \x1b[5m%s\x1b[25m (Use ESC/ARROW/ENTER", editorFindCallback);
-    if (query == NULL)
-        free(query);
-    else {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_colloff;
-        E.rowoff = saved_rowoff;
+void screenCompilePens() {
+    // SGR sequence of every pen, so that switching pens is one copy
+    int i;
+    for (i = 0; i < CELL_PENS; i++) {
+        int style = i / 100, fg = FG_BLACK + i / 10 % 10, bg = BG_BLACK + i % 10;
+        char *buf = pen_sgr[i];
+        int size = sizeof(pen_sgr[i]), len = 0;
+        len += snprintf(buf + len, size - len, "\x1b[0");
+        if (style & CELL_BOLD) len += snprintf(buf + len, size - len, ";1");
+        if (style & CELL_BLINK) len += snprintf(buf + len, size - len, ";5");
+        if (style & CELL_INVERSE) len += snprintf(buf + len, size - len, ";7");
+        if (fg != FG_DEFAULT) len += snprintf(buf + len, size - len, ";%d", fg);
+        if (bg != BG_DEFAULT) len += snprintf(buf + len, size - len, ";%d", bg);
+        len += snprintf(buf + len, size - len, "m");
+        pen_sgr_len[i] = len;
     }
 }
 
+void screenSetPen(struct abuf *ab, const cell *pen) {
+    int i = cellPen(pen);
+    abAppend(ab, pen_sgr[i], pen_sgr_len[i]);
+}
 
-/*----- append buffer -----*/
-
-struct abuf {
-    char *b;
-    int len;
-};
+// Sends cells x to end of row c, which all have the same pen
+void screenPutRun(struct abuf *ab, cell *pen, const cell *c, int x, int end) {
+    if (!cellSamePen(&c[x], pen)) {
+        *pen = c[x];
+        screenSetPen(ab, pen);
+    }
+    char *p = abReserve(ab, end - x);
+    if (p == NULL) return;
+    for (; x < end; x++)
+        *p++ = c[x].ch;
+}
 
-#define ABUF_INIT {NULL, 0}
+void screenMoveTo(struct abuf *ab, int y, int x) {
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+    abAppend(ab, buf, len);
+}
 
-void abAppend(struct abuf *ab, const char *s, int len){
-    char *new = realloc(ab->b, ab->len + len);
-    if (new == NULL){
-        return;
+// Scrolls rows top to top+rows-1 of the terminal up by n lines, or down
+// when n is negative, and E.shadow along with them
+void screenScroll(struct abuf *ab, int top, int rows, int n) {
+    cell blank = {' ', FG_DEFAULT, BG_DEFAULT, 0};
+    char buf[48];
+    // DECSTBM keeps the bars below the region in place; resetting it
+    // afterwards homes the cursor, which the next flush moves anyway
+    int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dr\x1b[%d%c\x1b[r",
+                       top + 1, top + rows, abs(n), n > 0 ? 'S' : 'T');
+    abAppend(ab, buf, len);
+
+    int cols = E.framecols;
+    cell *s = &E.shadow[(size_t)top * cols];
+    int keep = rows - abs(n);
+    int x;
+    if (n > 0) {
+        memmove(s, s + (size_t)n * cols, (size_t)keep * cols * sizeof(cell));
+        s += (size_t)keep * cols;
+    } else {
+        memmove(s - (size_t)n * cols, s, (size_t)keep * cols * sizeof(cell));
     }
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
-    ab->len += len;
+    for (x = 0; x < abs(n) * cols; x++)
+        s[x] = blank;
 }
 
-void abFree(struct abuf *ab){
-    free(ab->b);
+// Bytes past ASCII may be parts of one multi-byte character on the terminal
+int screenRowMultibyte(const cell *c, int cols) {
+    int x;
+    for (x = 0; x < cols; x++)
+        if (c[x].ch & 0x80) return 1;
+    return 0;
+}
+
+// Sends the cells of E.frame that differ from E.shadow, returns whether any did
+int screenFlush(struct abuf *ab) {
+    cell blank = {' ', FG_DEFAULT, BG_DEFAULT, 0};
+    int cols = E.framecols;
+    int start = ab->len;
+    int y, x;
+
+    if (E.repaint) {
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        for (x = 0; x < E.framerows * cols; x++)
+            E.shadow[x] = blank;
+        E.repaint = 0;
+    }
+
+    // The terminal pen is reset between frames; cx is -1 when the
+    // terminal cursor position is unknown
+    cell pen = blank;
+    int cy = -1, cx = -1;
+    for (y = 0; y < E.framerows; y++) {
+        cell *new = &E.frame[(size_t)y * cols];
+        cell *old = &E.shadow[(size_t)y * cols];
+        if (memcmp(new, old, cols * sizeof(cell)) == 0)
+            continue;
+
+        // Blank tail of the row, cleared with a single EL
+        int tail = cols;
+        while (tail > 0 && cellBlank(&new[tail - 1]))
+            tail--;
+
+        // A partial update could split a multi-byte character, so such
+        // rows are rewritten whole
+        int whole = screenRowMultibyte(new, cols) || screenRowMultibyte(old, cols);
+        if (whole) {
+            screenMoveTo(ab, y, 0);
+            for (x = 0; x < tail; ) {
+                int end = x + 1;
+                while (end < tail && cellSamePen(&new[end], &new[x]))
+                    end++;
+                screenPutRun(ab, &pen, new, x, end);
+                x = end;
+            }
+            cx = -1;
+        }
+
+        for (x = whole ? tail : 0; x < cols; x++) {
+            if (!whole && cellEqual(&new[x], &old[x]))
+                continue;
+            if (x >= tail) {
+                // Everything left on the row is blank
+                if (!whole && (cy != y || cx != x))
+                    screenMoveTo(ab, y, x);
+                if (!cellSamePen(&pen, &blank)) {
+                    pen = blank;
+                    abAppend(ab, "\x1b[m", 3);
+                }
+                abAppend(ab, "\x1b[K", 3);
+                cy = y;
+                cx = whole ? -1 : x;
+                break;
+            }
+            if (cy != y || cx < 0 || cx > x) {
+                screenMoveTo(ab, y, x);
+            } else if (cx < x) {
+                // Rewriting a short gap is cheaper than a cursor move
+                int gap = x - cx <= COPYCAT_SKIP_GAP;
+                int j;
+                for (j = cx; gap && j < x; j++)
+                    if (!cellSamePen(&new[j], &pen)) gap = 0;
+                if (gap) {
+                    screenPutRun(ab, &pen, new, cx, x);
+                } else {
+                    screenMoveTo(ab, y, x);
+                }
+            }
+            // The changed cells from x on that share its pen
+            int end = x + 1;
+            while (end < tail && !cellEqual(&new[end], &old[end]) &&
+                   cellSamePen(&new[end], &new[x]))
+                end++;
+            screenPutRun(ab, &pen, new, x, end);
+            cy = y;
+            cx = end;
+            x = end - 1;
+        }
+        memcpy(old, new, cols * sizeof(cell));
+    }
+    if (!cellSamePen(&pen, &blank))
+        abAppend(ab, "\x1b[m", 3);
+    return ab->len != start;
 }
 
 /*----- output -----*/
@@ -1143,7 +5377,7 @@ void abFree(struct abuf *ab){
 void editorScroll(){
     E.rx = 0;
     if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
     if (E.cy < E.rowoff) {
         // If the cursor is above visible window
@@ -1158,11 +5392,15 @@ void editorScroll(){
         E.coloff = E.rx - E.screencols + 1;
 }
 
-void editorDrawRows(struct abuf *ab){
+void editorDrawRows(){
+    cell pen = {' ', FG_DEFAULT, BG_DEFAULT, 0};
+    rowIter it;
+    rowIterInit(&it, E.rowoff);
     int y=0;
     for(; y < E.screenrows; y++){
-        int filerows = y + E.rowoff;
-        if (filerows >= E.numrows){
+        erow *row = rowIterNext(&it);
+        int x = 0;
+        if (row == NULL){
             if (E.numrows == 0 && y == E.screenrows / 4){
                 char welcome[80];
                 int welcomelen = snprintf(welcome, sizeof(welcome),
@@ -1171,126 +5409,172 @@ void editorDrawRows(struct abuf *ab){
                     welcomelen = E.screencols;
                 int padding = (E.screencols - welcomelen) / 2;
                 if (padding) {
-                    abAppend(ab, "~", 1);
+                    x = screenPut(y, x, "~", 1, pen);
                     padding--;
                 }
                 while (padding--)
-                    abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
+                    x = screenPut(y, x, " ", 1, pen);
+                x = screenPut(y, x, welcome, welcomelen, pen);
             } else {
-                abAppend(ab, "~", 1);
+                x = screenPut(y, x, "~", 1, pen);
             }
         } else {
             // Print the content of data row-wise
-            int len = E.row[filerows].rsize - E.coloff;
+            editorRowRender(row);
+            int len = row->rsize - E.coloff;
             if (len < 0) len = 0; // User scrolling past the end of line
             if (len > E.screencols) len = E.screencols;
-            char *c = &E.row[filerows].renders[E.coloff];
-            unsigned char *hl = &E.row[filerows].hl[E.coloff];
-            int current_color = -1;
-            int j;
-            for (j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        // To reset the color back to what was going on
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abAppend(ab, buf, clen);
+            char *c = &row->renders[E.coloff];
+            unsigned char *hl = &row->hl[E.coloff];
+            cell *out = screenRow(y);
+            while (x < len) {
+                // Runs of one highlight share their color
+                int h = hl[x];
+                int fg = h == HL_NORMAL ? FG_DEFAULT : editorSyntaxToColor(h);
+                int end = x + 1;
+                while (end < len && hl[end] == h)
+                    end++;
+                for (; x < end; x++) {
+                    if (iscntrl(c[x])) {
+                        out[x].ch = (c[x] <= 26) ? '@' + c[x] : '?';
+                        out[x].fg = FG_DEFAULT;
+                        out[x].style = CELL_INVERSE;
+                    } else {
+                        out[x].ch = c[x];
+                        out[x].fg = fg;
+                        out[x].style = 0;
                     }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1){
-                        abAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (current_color != color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        abAppend(ab, buf, clen);
-                    }
-                    abAppend(ab, &c[j], 1);
+                    out[x].bg = BG_DEFAULT;
                 }
             }
-            abAppend(ab, "\x1b[39m", 5);
         }
         // Erase the part of line to the right of curson
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
-    }    
-}
-
-void editorDrawStatusBar(struct abuf *ab) {
-    // Graphic Rendition
-    // https://vt100.net/docs/vt100-ug/chapter3.html#SGR
-    // 0: Attributes Off (Default)
-    // 1: Bold
-    // 4: Underscore
-    // 5: Blink
-    // 7: Negative image
-    abAppend(ab, "\x1b[7m", 4);      // Invert color of output
+        screenClear(y, x);
+    }
+}
+
+void editorDrawStatusBar() {
+    cell pen = {' ', FG_DEFAULT, BG_DEFAULT, CELL_INVERSE};
+    int y = E.screenrows;
     char status[80], rstatus[80];
     int len = snprintf(status, sizeof(status), "%.20s %s- %d lines",
         E.filename ? E.filename : "[No Name]", 
         E.dirty ? "(modified) " : "", 
         E.numrows);
+    if (E.load.active) {
+        pthread_mutex_lock(&E.load.lock);
+        size_t bytes = E.load.bytes;
+        pthread_mutex_unlock(&E.load.lock);
+        len = snprintf(status, sizeof(status), "%.20s - %s... %d lines / %zu MB",
+            E.filename ? E.filename : "[stdin]", E.load.follow ? "following" : "loading",
+            E.numrows, bytes >> 20);
+    }
     int rlen = snprintf(rstatus, sizeof(status), "%s | %d/%d",
         E.syntax ? E.syntax->filetype : "no ft",
         E.cy + 1, E.numrows);
+    if ((E.search.active || E.search.error) && rlen < (int)sizeof(rstatus)) {
+        // Position among the matches of the running search, N+ while
+        // the workers are still counting
+        int k = editorSearchIndex(E.cy, E.cx);
+        int at = k < E.search.nmatches && E.search.matches[k].row == E.cy &&
+                 E.search.matches[k].col == E.cx;
+        const char *more = editorSearchComplete() ? "" : "+";
+        const char *mode = E.search.regex ? "regex " : "";
+        char count[40];
+        int clen;
+        if (E.search.error)
+            clen = snprintf(count, sizeof(count), "regex: %s | ", E.search.error);
+        else if (at)
+            clen = snprintf(count, sizeof(count), "%smatch %d of %d%s | ",
+                mode, k + 1, E.search.total, more);
+        else
+            clen = snprintf(count, sizeof(count), "%s%d%s matches | ",
+                mode, E.search.total, more);
+        if (clen + rlen < (int)sizeof(rstatus)) {
+            memmove(rstatus + clen, rstatus, rlen + 1);
+            memcpy(rstatus, count, clen);
+            rlen += clen;
+        }
+    }
     if (len > E.screencols) len = E.screencols;
-    abAppend(ab, status, len);
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
-            break;
+    int x = screenPut(y, 0, status, len, pen);
+    while (x < E.screencols) {
+        if (E.screencols - x == rlen) {
+            x = screenPut(y, x, rstatus, rlen, pen);
         } else {
-            abAppend(ab, " ", 1);
-            len++;
+            x = screenPut(y, x, " ", 1, pen);
         }
     }
-    abAppend(ab, "\x1b[m", 3);      // Reset the color in output
-    abAppend(ab, "\r\n", 2);
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
-    abAppend(ab, "\x1b[K", 3);      // Clear the msgBar text
-    int msglen = strlen(E.statusmsg);
-    if (msglen > E.screencols) msglen = E.screencols;
-    if (msglen && time(NULL) - E.statusmsg_time < 10)
-        // Display only if not older than 10 seconds
-        abAppend(ab, E.statusmsg, msglen);
+void editorDrawMessageBar() {
+    cell pen = {' ', FG_DEFAULT, BG_DEFAULT, 0};
+    int y = E.screenrows + 1;
+    int x = 0;
+    if (time(NULL) - E.statusmsg_time < COPYCAT_STATUS_TIME) {
+        // Display only if not older than 10 seconds. Messages may carry
+        // their own SGR sequences, which set the pen of what follows
+        const char *s = E.statusmsg;
+        while (*s && x < E.screencols) {
+            if (s[0] == '\x1b' && s[1] == '[') {
+                s = screenParseSgr(s + 2, &pen);
+            } else {
+                x = screenPut(y, x, s, 1, pen);
+                s++;
+            }
+        }
+    }
+    screenClear(y, x);
 }
 
 void editorRefreshScreen(){
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
-
-    // Hide cursor when refreshing
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
-
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
+
+    struct abuf *ab = &E.out;
+    ab->len = 0;
+
+    // Hide cursor when refreshing, unless nothing changed at all. The
+    // frame is a synchronized update (DEC mode 2026), shown by terminals
+    // that support it only once complete
+    abAppend(ab, "\x1b[?2026h\x1b[?25l", 14);
+    int changed = 0;
+    int shift = E.rowoff - E.shadow_rowoff;
+    if (!E.repaint && shift != 0 && abs(shift) < E.screenrows) {
+        // Rows still on screen are moved by the terminal, so only the
+        // newly exposed ones are drawn
+        screenScroll(ab, 0, E.screenrows, shift);
+        changed = 1;
+    }
+    E.shadow_rowoff = E.rowoff;
+    changed |= screenFlush(ab);
+    if (!changed)
+        ab->len = 0;
 
     char buf[35];
     snprintf(buf, sizeof(buf), "\x1b[%d;%dH", 
                             (E.cy - E.rowoff) + 1, 
                             (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
-    
+    abAppend(ab, buf, strlen(buf));
+
     // Show cursor
-    abAppend(&ab, "\x1b[?25h", 6);
+    if (changed)
+        abAppend(ab, "\x1b[?25h\x1b[?2026l", 14);
+
+    writeAll(STDOUT_FILENO, ab->b, ab->len);
+    E.frame_ms = editorClockMs();
+}
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+// Refreshes the screen unless more input is waiting, so that a burst of
+// keys is drawn as one frame; the frame is held back at most
+// COPYCAT_FRAME_DEFER ms
+void editorRefreshScreenLazy(){
+    if (editorInputPending() && editorClockMs() - E.frame_ms < COPYCAT_FRAME_DEFER)
+        return;
+    editorRefreshScreen();
 }
 
 void editorSetStatusMessage(const char *fmt, ...) {
@@ -1302,6 +5586,8 @@ void editorSetStatusMessage(const char *fmt, ...) {
     vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
     va_end(ap);
     E.statusmsg_time = time(NULL);
+    // Redraw once the message has expired
+    editorSetTimer(COPYCAT_STATUS_TIME * 1000);
 }
 
 /*----- input -----*/
@@ -1312,25 +5598,40 @@ char *editorPrompt(char *prompt, void(*callback)(char *, int)) {
 
     size_t buflen = 0;
     buf[0] = '\0';
+    E.prompting++;
 
     while(1) {
         editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        editorRefreshScreenLazy();
 
         int c = editorReadKey();
+        if (c == REFRESH_KEY) continue;
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
             if (buflen != 0) buf[--buflen] = '\0';
         } else if (c == '\x1b') {
             editorSetStatusMessage("");
             if (callback) callback(buf, c);
             free(buf);
+            E.prompting--;
             return NULL;
         } else if (c=='\r') {
             if (buflen != 0) {
                 editorSetStatusMessage("");
                 if (callback) callback(buf, c);
+                E.prompting--;
                 return buf;
             }
+        } else if (c == PASTE_KEY) {
+            // Pasted text up to its first line break
+            size_t next;
+            size_t len = editorLineLength(E.input.paste, E.input.pastelen, &next);
+            if (buflen + len >= bufsize) {
+                bufsize = buflen + len + 1;
+                buf = realloc(buf, bufsize);
+            }
+            memcpy(&buf[buflen], E.input.paste, len);
+            buflen += len;
+            buf[buflen] = '\0';
         } else if (!iscntrl(c) && c < 128) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
@@ -1345,7 +5646,7 @@ char *editorPrompt(char *prompt, void(*callback)(char *, int)) {
 }
 
 void editorMoveCursor(int key){
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = editorRowAt(E.cy);
     switch (key)
     {
         case ARROW_LEFT:
@@ -1353,7 +5654,7 @@ void editorMoveCursor(int key){
                 E.cx--;
             else if (E.cy > 0) {
                 E.cy--;
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             }
             break;
         case ARROW_RIGHT:
@@ -1376,7 +5677,7 @@ void editorMoveCursor(int key){
             break;
     }
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = editorRowAt(E.cy);
     int rowlen = row ? row->size : 0;
     if (E.cx > rowlen)
         E.cx = rowlen;
@@ -1386,6 +5687,22 @@ void editorProcessKeyPress(){
     static int quit_times = COPYCAT_QUIT_TIMES;
 
     int c = editorReadKey();
+    if (E.load.active || E.load.cancel) {
+        // Moving around, finding and copying work while the file loads
+        switch (c) {
+            case '\x1b':
+                if (E.load.active) editorLoadCancel();
+                return;
+            case HOME_KEY: case END_KEY: case PAGE_UP: case PAGE_DOWN:
+            case ARROW_UP: case ARROW_DOWN: case ARROW_LEFT: case ARROW_RIGHT:
+            case CTRL_KEY('q'): case CTRL_KEY('f'): case CTRL_KEY('c'):
+            case CTRL_KEY('l'): case REFRESH_KEY:
+                break;
+            default:
+                editorReadOnly();
+                return;
+        }
+    }
     switch (c){
         case '\r':
             editorInsertNewLine();
@@ -1399,6 +5716,7 @@ void editorProcessKeyPress(){
                     quit_times--;
                     return;
             }
+            swapClose();
             screenWipe();
             exit(0);
             break;
@@ -1410,7 +5728,7 @@ void editorProcessKeyPress(){
         case END_KEY:
             if (E.cy < E.numrows)
                 // Bring cursor to the end of line
-                E.cx = E.row[E.cy].size;
+                E.cx = editorRowAt(E.cy)->size;
             break;
         
         case PAGE_DOWN:
@@ -1451,7 +5769,19 @@ void editorProcessKeyPress(){
             editorFind();
             break;
 
+        case CTRL_KEY('r'):
+            editorReplace();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
         case CTRL_KEY('l'):
+        case REFRESH_KEY:
         case '\x1b':
             // Screen Refresh
             break;
@@ -1474,6 +5804,10 @@ void editorProcessKeyPress(){
             editorMoveRow(c == CTRL_KEY('k') ? 1 : -1);
             break;
 
+        case PASTE_KEY:
+            editorInsertText(E.input.paste, E.input.pastelen);
+            break;
+
         default:
             editorInsertChar(c);
             break;
@@ -1481,6 +5815,506 @@ void editorProcessKeyPress(){
     quit_times = COPYCAT_QUIT_TIMES;
 }
 
+/*----- benchmarks -----*/
+
+#ifdef COPYCAT_BENCH
+/*
+    `make bench` builds copycat-bench.out, which times the hot paths of
+    the editor on a file instead of opening it:
+        ./copycat-bench.out FILE [NEEDLE [REGEX]]
+*/
+
+int editorLexRowReference(char *s, int len, unsigned char *hl, int in_comment) {
+    // The rule by rule lexer that editorLexRow() replaced
+    memset(hl, HL_NORMAL, len);
+
+    if (E.syntax == NULL) return 0;
+
+    struct keywordSet *keywords = E.keywords;
+
+    char *scs = E.syntax->single_line_comment_start;
+    int scs_len = scs ? strlen(scs) : 0;
+
+    char *mcs = E.syntax->multi_line_comment_start;
+    int mcs_len = mcs ? strlen(mcs) : 0;
+    char *mce = E.syntax->multi_line_comment_end;
+    int mce_len = mce ? strlen(mce) : 0;
+    
+    int prev_sep = 1;
+    int in_string = 0;
+
+    int  i;
+    for (i = 0; i < len;) {
+        char c = s[i];
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NUMBER;
+
+        // Single Line Comments Highlight
+        if (scs_len && !in_string && !in_comment) {
+            if (i + scs_len <= len && !strncmp(&s[i], scs, scs_len)) {
+                memset(&hl[i], HL_COMMENT, len - i);
+                break;
+            }
+        }
+
+        // Multi Line Comments Highlight
+        if (mcs_len && mce_len && !in_string) {
+            if (in_comment) {
+                hl[i] = HL_COMMENT;
+                if (i + mce_len <= len && !strncmp(&s[i], mce, mce_len)) {
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+                    continue;
+                } else {
+                    i++;
+                    continue;
+                }
+            } else if (i + mcs_len <= len && !strncmp(&s[i], mcs, mcs_len)) {
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+
+        // String Highlight
+        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (in_string) {
+                hl[i] = HL_STRINGS;
+
+                // Two characters at once
+                if (c == '\\' && i + 1 < len) {
+                    hl[i+1] = HL_STRINGS;
+                    i += 2;
+                    continue;
+                }
+
+                // End of Double Inverteds or Single Inverteds
+                if (c == in_string)
+                    in_string = 0;
+                i++;
+                prev_sep = 1;
+                continue;
+            } else {
+                if (c == '"' || c == '\'') {
+                    in_string = c;
+                    hl[i] = HL_STRINGS;
+                    i++;
+                    continue;
+                }
+            }
+        }
+
+        // Number Highlight
+        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
+                (c == '.' && prev_hl == HL_NUMBER)) {
+                hl[i] = HL_NUMBER;
+                i++;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        // Keywords
+        if (prev_sep) {
+            // No keyword contains a separator, so a keyword followed by a
+            // separator is exactly the token starting here
+            int klen = 0;
+            while (i + klen < len && klen <= keywords->maxlen &&
+                   !is_separator(s[i + klen]))
+                klen++;
+
+            int kw = kwLookup(keywords, &s[i], klen);
+            if (kw != HL_NORMAL) {
+                memset(&hl[i], kw, klen);
+                i += klen;
+                prev_sep = 0;
+                continue;
+            }
+        }
+
+        prev_sep = is_separator(c);
+        i++;
+    }
+
+    return in_comment;
+}
+
+double benchNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double benchLex(int (*lex)(char *, int, unsigned char *, int), unsigned char *hl) {
+    // Seconds lex takes to highlight every row in order
+    int in = 0;
+    rowIter it;
+    erow *row;
+    double start = benchNow();
+    rowIterInit(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL)
+        in = lex(row->chars, row->size, hl, in);
+    return benchNow() - start;
+}
+
+void benchHighlight() {
+    int cap = 1, diffs = 0;
+    long bytes = 0;
+    rowIter it;
+    erow *row;
+    rowIterInit(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL) {
+        bytes += row->size;
+        if (cap <= row->size) cap = row->size + 1;
+    }
+    unsigned char *hl = malloc(cap);
+    unsigned char *ref = malloc(cap);
+
+    benchLex(editorLexRow, hl);     // Fault the file in first
+    double t_table = benchLex(editorLexRow, hl);
+    double t_ref = benchLex(editorLexRowReference, hl);
+
+    // Both lexers must agree on every byte and every row's end state
+    int in = 0, refin = 0;
+    rowIterInit(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL) {
+        in = editorLexRow(row->chars, row->size, hl, in);
+        refin = editorLexRowReference(row->chars, row->size, ref, refin);
+        if (in != refin || memcmp(hl, ref, row->size))
+            diffs++;
+    }
+
+    printf("highlight %s: %d rows, %ld bytes\n",
+           E.syntax ? E.syntax->filetype : "no ft", E.numrows, bytes);
+    printf("  table lexer     %8.3f ms\n", t_table * 1e3);
+    printf("  reference lexer %8.3f ms\n", t_ref * 1e3);
+    printf("  rows highlighted differently: %d\n", diffs);
+    free(hl);
+    free(ref);
+}
+
+void benchFrame() {
+    // Full frames of a 300 row screen, drawn and diffed but not written
+    int frames = 2000;
+    int rows = E.screenrows, cols = E.screencols;
+    E.screenrows = 298;
+    E.screencols = 80;
+    screenResize();
+    long bytes = 0;
+    double start = 0;
+    int i;
+    for (i = -100; i < frames; i++) {
+        if (i == 0) start = benchNow();     // After warming the render cache
+        E.rowoff = E.numrows ? (i + 100) * 7 % E.numrows : 0;
+        E.repaint = 1;
+        E.out.len = 0;
+        editorDrawRows();
+        editorDrawStatusBar();
+        editorDrawMessageBar();
+        screenFlush(&E.out);
+        if (i >= 0) bytes += E.out.len;
+    }
+    double t = benchNow() - start;
+    printf("frame %dx%d: %d frames\n", E.screenrows + 2, E.screencols, frames);
+    printf("  build           %8.3f us/frame, %ld bytes/frame\n",
+           t * 1e6 / frames, bytes / frames);
+    E.screenrows = rows;
+    E.screencols = cols;
+    screenResize();
+}
+
+int editorSearchRowsReference(const char *query, size_t len, int from, int to, int *col) {
+    // The row by row search that editorSearchRows() replaced
+    rowIter it;
+    erow *row;
+    rowIterInit(&it, from);
+    for (; from < to && (row = rowIterNext(&it)) != NULL; from++) {
+        char *match = memmem(row->chars, row->size, query, len);
+        if (match) {
+            *col = match - row->chars;
+            return from;
+        }
+    }
+    return -1;
+}
+
+double benchSearchAll(int (*search)(const char *, size_t, int, int, int *),
+                      const char *query, int *found, long *sum) {
+    // Seconds search takes to step through every row holding query
+    size_t len = strlen(query);
+    int at = 0, col;
+    *found = 0;
+    *sum = 0;
+    double start = benchNow();
+    while ((at = search(query, len, at, E.numrows, &col)) != -1) {
+        (*found)++;
+        *sum += (long)at * 31 + col;
+        at++;
+    }
+    return benchNow() - start;
+}
+
+void benchSearch(const char *query) {
+    long bytes = 0;
+    rowIter it;
+    erow *row;
+    rowIterInit(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL)
+        bytes += row->size + 1;
+
+    int found, reffound;
+    long sum, refsum;
+    benchSearchAll(editorSearchRows, query, &found, &sum);     // Fault the file in
+    double t = benchSearchAll(editorSearchRows, query, &found, &sum);
+    double t_ref = benchSearchAll(editorSearchRowsReference, query, &reffound, &refsum);
+
+    printf("search \"%s\": %d rows match\n", query, found);
+    printf("  stream search   %8.3f ms, %6.2f GB/s\n", t * 1e3, bytes / t / 1e9);
+    printf("  row by row      %8.3f ms, %6.2f GB/s\n", t_ref * 1e3, bytes / t_ref / 1e9);
+    printf("  results %s\n", found == reffound && sum == refsum ? "agree" : "DIFFER");
+
+    // Every match, on the worker pool and on this thread alone
+    size_t len = strlen(query);
+    long count = 0;
+    double start = benchNow();
+    rowIterInit(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL) {
+        const char *p = row->chars, *end = row->chars + row->size;
+        while ((p = searchMem(p, end - p, query, len)) != NULL) {
+            count++;
+            p += len;
+        }
+    }
+    double t_one = benchNow() - start;
+    start = benchNow();
+    editorSearchStart(query);
+    editorSearchWait();
+    double t_pool = benchNow() - start;
+    printf("  count matches: %d on %d threads\n", E.search.total, E.search.nthreads);
+    printf("  worker pool     %8.3f ms, %6.2f GB/s\n", t_pool * 1e3, bytes / t_pool / 1e9);
+    printf("  one thread      %8.3f ms, %6.2f GB/s\n", t_one * 1e3, bytes / t_one / 1e9);
+    printf("  results %s\n", count == E.search.total ? "agree" : "DIFFER");
+    editorSearchStop();
+
+    // Typing the last byte of the query after the rest
+    if (len < 2) return;
+    char *shorter = strndup(query, len - 1);
+    editorSearchStart(shorter);
+    editorSearchWait();
+    int candidates = E.search.nrows;
+    start = benchNow();
+    editorSearchStart(query);
+    editorSearchWait();
+    double t_narrow = benchNow() - start;
+    printf("  narrowed from %d rows of \"%s\"\n", candidates, shorter);
+    printf("  narrowed        %8.3f ms\n", t_narrow * 1e3);
+    printf("  results %s\n", count == E.search.total ? "agree" : "DIFFER");
+    editorSearchStop();
+    free(shorter);
+}
+
+void benchRegex(const char *pattern) {
+    // The DFA engine against POSIX regexec() on every row
+    const char *error;
+    regex *rx = rxCompile(pattern, &error);
+    regex_t re;
+    if (rx == NULL || regcomp(&re, pattern, REG_EXTENDED) != 0) {
+        printf("regex \"%s\": %s\n", pattern, rx ? "not POSIX" : error);
+        rxFree(rx);
+        return;
+    }
+    rxMatcher m;
+    memset(&m, 0, sizeof(m));
+    rxMatcherInit(&m, rx);
+
+    long bytes = 0;
+    int found = 0, reffound = 0, differ = 0;
+    rowIter it;
+    erow *row;
+    double start = benchNow();
+    int at = 0, col, mlen;
+    while ((at = editorSearchRowsRegex(&m, at, E.numrows, &col, &mlen)) != -1) {
+        found++;
+        at++;
+    }
+    double t = benchNow() - start;
+
+    char *line = NULL;
+    int cap = 0;
+    start = benchNow();
+    rowIterInit(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL) {
+        if (row->size + 1 > cap) {
+            cap = row->size + 1;
+            line = realloc(line, cap);
+        }
+        memcpy(line, row->chars, row->size);
+        line[row->size] = '\0';
+        bytes += row->size + 1;
+        regmatch_t pm;
+        if (regexec(&re, line, 1, &pm, 0) == 0) {
+            reffound++;
+            col = rxMatch(&m, row->chars, row->size, 0, &mlen);
+            if (col != pm.rm_so || mlen != pm.rm_eo - pm.rm_so) differ++;
+        }
+    }
+    double t_ref = benchNow() - start;
+
+    printf("regex \"%s\": %d rows match, prefix \"%.*s\"\n", pattern, found,
+        rx->prefixlen, rx->prefix);
+    printf("  lazy DFA        %8.3f ms, %6.2f GB/s\n", t * 1e3, bytes / t / 1e9);
+    printf("  regexec         %8.3f ms, %6.2f GB/s\n", t_ref * 1e3, bytes / t_ref / 1e9);
+    printf("  results %s\n", found == reffound && differ == 0 ? "agree" : "DIFFER");
+
+    start = benchNow();
+    E.search.regex = 1;
+    editorSearchStart(pattern);
+    editorSearchWait();
+    double t_pool = benchNow() - start;
+    printf("  count matches: %d on %d threads\n", E.search.total, E.search.nthreads);
+    printf("  worker pool     %8.3f ms, %6.2f GB/s\n", t_pool * 1e3, bytes / t_pool / 1e9);
+    editorSearchStop();
+    E.search.regex = 0;
+    free(line);
+    rxMatcherFree(&m);
+    rxFree(rx);
+    regfree(&re);
+}
+
+void benchIndex(const char *query) {
+    // Searches for query through the whole file, with and without an index
+    E.index.enabled = 1;
+    pthread_mutex_init(&E.index.lock, NULL);
+    indexBuild(&E.index);
+    printf("index: %d blocks, %.1f MB, built in %lld ms\n", E.index.orig.nblocks,
+        E.index.orig.nblocks * COPYCAT_INDEX_WORDS * 8 / 1e6, E.index.ms);
+
+    size_t len = strlen(query);
+    int found[2], col, i;
+    double t[2];
+    for (i = 0; i < 2; i++) {
+        E.index.enabled = i == 0;
+        double start = benchNow();
+        int at = 0;
+        found[i] = 0;
+        while ((at = editorSearchRows(query, len, at, E.numrows, &col)) != -1) {
+            found[i]++;
+            at++;
+        }
+        t[i] = benchNow() - start;
+    }
+    E.index.enabled = 1;
+    struct indexQuery q;
+    indexQueryInit(&q, query, len);
+    int candidates = 0;
+    for (i = 0; i < E.index.orig.nblocks; i++)
+        candidates += indexBlockHas(&E.index.orig, i, &q);
+    printf("search \"%s\": %d rows match, %d blocks to search\n", query, found[0], candidates);
+    printf("  with index      %8.3f ms\n", t[0] * 1e3);
+    printf("  without         %8.3f ms\n", t[1] * 1e3);
+    printf("  results %s\n", found[0] == found[1] ? "agree" : "DIFFER");
+}
+
+unsigned long long benchChecksum() {
+    // FNV-1a of the document, to tell it came back as it was
+    unsigned long long h = 14695981039346656037ULL;
+    rowIter it;
+    erow *row;
+    int i;
+    rowIterInit(&it, 0);
+    while ((row = rowIterNext(&it)) != NULL) {
+        for (i = 0; i < row->size; i++)
+            h = (h ^ (unsigned char)row->chars[i]) * 1099511628211ULL;
+        h = (h ^ '\n') * 1099511628211ULL;
+    }
+    return h;
+}
+
+void benchUndo(int steps) {
+    // Types a character on each of steps rows, then undoes and redoes
+    // all of them; the last bench, as edited rows stay in the add buffer
+    if (E.numrows == 0) return;
+    unsigned long long sum = benchChecksum();
+    int i;
+    double t[3], start = benchNow();
+    for (i = 0; i < steps; i++) {
+        E.cy = (long long)i * 7919 % E.numrows;
+        E.cx = 0;
+        editorInsertChar('a' + i % 26);
+    }
+    t[0] = benchNow() - start;
+    unsigned long long edited = benchChecksum();
+    size_t bytes = E.undo.bytes;
+
+    start = benchNow();
+    for (i = 0; i < steps; i++)
+        editorUndo();
+    t[1] = benchNow() - start;
+    int agree = benchChecksum() == sum;
+    start = benchNow();
+    for (i = 0; i < steps; i++)
+        editorRedo();
+    t[2] = benchNow() - start;
+    agree = agree && benchChecksum() == edited;
+    for (i = 0; i < steps; i++)
+        editorUndo();
+
+    printf("undo: %d steps, %.1f MB of journal\n", steps, bytes / 1e6);
+    printf("  edit            %8.3f ms\n", t[0] * 1e3);
+    printf("  undo all        %8.3f ms\n", t[1] * 1e3);
+    printf("  redo all        %8.3f ms\n", t[2] * 1e3);
+    printf("  results %s\n", agree ? "agree" : "DIFFER");
+}
+
+void benchReplace(const char *query, const char *with) {
+    // Replaces every match, then counts what replaced them, and undoes it
+    double start = benchNow();
+    int n = editorReplaceAll(query, with);
+    double t = benchNow() - start;
+    editorSearchStart(with);
+    editorSearchWait();
+    int agree = n == E.search.total;
+    editorSearchStop();
+
+    start = benchNow();
+    editorUndo();
+    double tu = benchNow() - start;
+    editorSearchStart(query);
+    editorSearchWait();
+    agree = agree && n == E.search.total;
+    editorSearchStop();
+    printf("replace \"%s\" with \"%s\": %d occurrences\n", query, with, n);
+    printf("  replace all     %8.3f ms\n", t * 1e3);
+    printf("  undo            %8.3f ms\n", tu * 1e3);
+    printf("  results %s\n", agree ? "agree" : "DIFFER");
+}
+
+int editorBench(char *filename, char *needle, char *pattern) {
+    E.screenrows = 24;
+    E.screencols = 80;
+    editorCompileSyntax();
+    screenCompilePens();
+    editorOpen(filename);
+
+    benchHighlight();
+    benchFrame();
+    benchSearch("copycat: no such needle");
+    if (needle)
+        benchSearch(needle);
+    if (pattern)
+        benchRegex(pattern);
+    if (needle)
+        benchIndex(needle);
+    if (needle)
+        benchReplace(needle, "copycat: replaced");
+    benchUndo(1000000);
+    return 0;
+}
+#endif
+
 /*----- init -----*/
 void initEditor(){
     E.cx = 0;
@@ -1489,30 +6323,86 @@ void initEditor(){
     E.numrows = 0;
     E.rowoff = 0;
     E.coloff = 0;
-    E.row = NULL;
+    memset(&E.pt, 0, sizeof(E.pt));
+    memset(&E.input, 0, sizeof(E.input));
+    E.lru_head = NULL;
+    E.lru_tail = NULL;
+    E.numrendered = 0;
+    E.hl_frontier = 0;
+    E.frame = NULL;
+    E.shadow = NULL;
+    E.out = (struct abuf)ABUF_INIT;
+    E.frame_ms = 0;
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0]='\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    E.keywords = NULL;
+    E.lexer = NULL;
     E.clipboard = NULL;
-    if(getWindowSize(&E.screenrows, &E.screencols) == -1)
-        die("getWindowSize");
-    E.screenrows -= 2;
+    editorCompileSyntax();
+    screenCompilePens();
+    editorUpdateWindowSize();
+    editorInitEvents();
 }
 
 int main(int argc, char *argv[]){
+#ifdef COPYCAT_BENCH
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s FILE [NEEDLE [REGEX]]\n", argv[0]);
+        return 1;
+    }
+    return editorBench(argv[1], argc > 2 ? argv[2] : NULL, argc > 3 ? argv[3] : NULL);
+#endif
+    char *filename = NULL;
+    int input = 0;
+    int i;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-i") == 0)
+            E.index.enabled = 1;    // Index the file for search
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+            E.load.limit = (size_t)atol(argv[++i]) << 20;   // Keep at most MB of a stream
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            E.load.maxrows = atoi(argv[++i]);   // and at most this many rows
+        else if (strcmp(argv[i], "-f") == 0)
+            E.load.follow = 1;      // Keep reading the file as it grows
+        else if (strcmp(argv[i], "-") == 0)
+            input = 1;              // Stream stdin
+        else
+            filename = argv[i];
+    }
+    if (input) {
+        // Keys come from the terminal, stdin is the text
+        E.load.input = dup(STDIN_FILENO);
+        int tty = open("/dev/tty", O_RDWR);
+        if (E.load.input == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1) {
+            perror("/dev/tty");
+            exit(1);
+        }
+        close(tty);
+        fcntl(E.load.input, F_SETFD, FD_CLOEXEC);
+    }
     enableRawMode();
     initEditor();
-    if (argc >= 2)
-        editorOpen(argv[1]);
+    if (input)
+        editorLoadStart(NULL);
+    else if (filename)
+        editorLoadStart(filename);
     
-    editorSetStatusMessage("\x1b[%dm\x1b[%dmCOPYCAT\x1b[%dm\x1b[%dm: CTRL+S: Save | Ctrl+Q: Quit | CTRL+F: Find | Ctrl+J/K: Move Line Up/Down",
+    editorSetStatusMessage("\x1b[%dm\x1b[%dmCOPYCAT\x1b[%dm\x1b[%dm: CTRL+S: Save | Ctrl+Q: Quit | CTRL+F: Find | Ctrl+R: Replace | Ctrl+Z/Y: Undo/Redo | Ctrl+J/K: Move Line Up/Down",
                             FG_BLACK, BG_WHITE, BG_DEFAULT, FG_DEFAULT);
 
     while(1){
-        editorRefreshScreen();
+        editorRefreshScreenLazy();
         editorProcessKeyPress();
+        // Rows put off while a search ran, then the rest of opening
+        editorLoadCollect();
+        if (E.load.ready) {
+            E.load.ready = 0;
+            editorIndexStart();
+            editorSwapOpen();
+        }
     }
     return 0;
 }